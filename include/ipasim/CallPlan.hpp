@@ -0,0 +1,154 @@
+// CallPlan.hpp: Definition of classes `TypeDecoder`, `CallPlan` and
+// `TypeCache`.
+
+#ifndef IPASIM_CALL_PLAN_HPP
+#define IPASIM_CALL_PLAN_HPP
+
+#include <cstdint>
+#include <deque>
+#include <ffi.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ipasim {
+
+class DynamicLoader;
+
+// Layout of a type decoded by `TypeDecoder`. Sizes and alignments are the
+// guest's ones. Note that iOS armv7 follows APCS, where 64-bit types are
+// aligned to only 4 bytes (unlike on the host). The host's layout is described
+// by `FFIType`.
+struct TypeLayout {
+  enum KindTy : uint8_t { Void, Integer, Float, Aggregate } Kind;
+  uint32_t Size, Align;
+  bool IntegerLike; // Can be returned in `R0` (see `CallPlan::create`)
+  ffi_type *FFIType;
+  // Offsets of scalars in the aggregate in the order of `FFIType`'s leaves.
+  std::vector<uint32_t> Leaves;
+};
+
+// Owner of `ffi_type`s describing aggregates.
+struct FFITypeStorage {
+  std::deque<ffi_type> Types;
+  std::deque<std::vector<ffi_type *>> Elements;
+};
+
+// Helper class for decoding Objective-C's type encodings.
+class TypeDecoder {
+public:
+  TypeDecoder(const char *T, FFITypeStorage &Storage)
+      : T(T), Storage(Storage) {}
+  bool hasNext();
+  bool getNextType(TypeLayout &L);
+
+private:
+  const char *T;
+  FFITypeStorage &Storage;
+
+  void skipQualifiers();
+  void skipDigits();
+  bool skipType();
+  bool decode(TypeLayout &L);
+  bool decodeAggregate(TypeLayout &L, char Close, bool Union);
+  bool decodeArray(TypeLayout &L);
+  ffi_type *createAggregate(std::vector<ffi_type *> &&Elements);
+};
+
+// Compiled description of calls from the guest into native functions with the
+// same Objective-C type encoding. Arguments are assigned to 32-bit slots (i.e.,
+// registers `R0`-`R3` followed by the stack) once, so that calls themselves
+// (see `DynamicCaller`) don't have to decode anything.
+class CallPlan {
+public:
+  // Returns `nullptr` if the signature is not supported.
+  static std::unique_ptr<CallPlan> create(const char *Encoding);
+  CallPlan(const CallPlan &) = delete;
+
+  const TypeLayout &getReturnType() const { return Ret; }
+  // `true` if the result is stored into memory pointed to by `R0`
+  bool returnsIndirectly() const { return IndirectRet; }
+  size_t getArgCount() const { return Args.size(); }
+  const TypeLayout &getArgType(size_t I) const { return Args[I].Type; }
+  // Number of slots occupied by arguments (including the indirect result).
+  uint32_t getWordCount() const { return Words; }
+
+private:
+  friend class DynamicCaller;
+
+  // Copy of one scalar between the guest's and the host's layout.
+  struct Move {
+    uint32_t Guest, Host, Size;
+  };
+  struct Arg {
+    TypeLayout Type;
+    uint32_t Word;    // Index of the first slot
+    uint32_t Scratch; // Offset of the host copy (only if `Moves` are needed)
+    std::vector<Move> Moves; // Empty if the host's layout is the same
+  };
+
+  CallPlan() = default;
+  bool prepare();
+  static bool computeMoves(const TypeLayout &L, std::vector<Move> &Moves);
+
+  FFITypeStorage Types;
+  TypeLayout Ret;
+  bool IndirectRet;
+  std::vector<Move> RetMoves;
+  uint32_t RetScratch;
+  std::vector<Arg> Args;
+  std::vector<ffi_type *> ArgTypes;
+  uint32_t Words;
+  uint32_t ScratchSize; // Bytes needed for host copies and the result
+  ffi_cif CIF;
+};
+
+// Type encodings decoded by `TypeDecoder`, shared by `SysTranslator` and the
+// Objective-C runtime (see `ipaSim_getTypeLayout`). Encodings mostly come from
+// Mach-O metadata where they don't move, so they are looked up by their
+// addresses first. Tables are dropped as a whole when they grow too large, so
+// results are shared with callers.
+class TypeCache {
+public:
+  TypeCache(DynamicLoader &Dyld) : Dyld(Dyld) {}
+
+  // Returns `nullptr` if the method type encoding is not supported.
+  std::shared_ptr<const CallPlan> getCallPlan(const char *Encoding);
+  // Returns layout of the first type in `Encoding` (or `nullptr` if it's not
+  // supported).
+  std::shared_ptr<const TypeLayout> getType(const char *Encoding);
+
+private:
+  struct DecodedType {
+    FFITypeStorage Types;
+    TypeLayout Layout;
+  };
+  template <typename T> struct Table {
+    using ContentMap = std::unordered_map<std::string, std::shared_ptr<T>>;
+    struct AddressEntry {
+      const typename ContentMap::value_type *Entry;
+      bool Immutable; // The encoding is in an image's `__TEXT`
+    };
+    // Results keyed by contents of encodings (null if not supported)
+    ContentMap ByContent;
+    // Entries of `ByContent` keyed by addresses of encodings
+    std::unordered_map<const char *, AddressEntry> ByAddress;
+  };
+  static constexpr size_t MaxEntries = 0x10000; // Per table
+
+  template <typename T, typename FuncTy>
+  std::shared_ptr<T> lookup(Table<T> &Tab, const char *Encoding,
+                            FuncTy Decode);
+
+  DynamicLoader &Dyld;
+  std::mutex Mutex;
+  Table<CallPlan> Plans;
+  Table<DecodedType> Types;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_CALL_PLAN_HPP)
+#endif
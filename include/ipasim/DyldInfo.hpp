@@ -0,0 +1,47 @@
+// DyldInfo.hpp: Decoding of rebase and binding info from command
+// `LC_DYLD_INFO`.
+
+#ifndef IPASIM_DYLD_INFO_HPP
+#define IPASIM_DYLD_INFO_HPP
+
+#include <cstdint>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/STLExtras.h>
+
+namespace ipasim {
+
+// Address range of a segment referenced by `dyld` opcodes by its index.
+struct DyldSegment {
+  uint64_t Addr, Size;
+};
+
+// Pointer bound by `dyld` (see `forEachBind`).
+struct DyldBind {
+  uint64_t Addr;    // Address of the pointer
+  int32_t Ordinal;  // Library the symbol is imported from (1-based or special)
+  const char *Name; // Symbol's name
+  uint8_t Type;     // `BIND_TYPE_*`
+  int64_t Addend;
+};
+
+// Decodes rebase opcodes `Opcodes` without materializing the individual
+// pointers. Calls `Func(Addr, Count, Stride)` for each run of `Count` pointers
+// (starting at `Addr`, `Stride` bytes apart) that should be rebased. Addresses
+// are relative to `Segments`. Returns `false` if the opcodes are malformed or
+// use features we don't support. Inspired by
+// `ImageLoaderMachOCompressed::rebase`.
+bool forEachRebase(
+    llvm::ArrayRef<uint8_t> Opcodes, llvm::ArrayRef<DyldSegment> Segments,
+    llvm::function_ref<void(uint64_t, uint32_t, uint32_t)> Func);
+// Decodes binding opcodes `Opcodes` and calls `Func` for each bound pointer.
+// If `Func` returns `false`, decoding stops. In lazy binding info (if `Lazy` is
+// `true`), `BIND_OPCODE_DONE` only separates bindings. Inspired by
+// `ImageLoaderMachOCompressed::eachBind`.
+bool forEachBind(llvm::ArrayRef<uint8_t> Opcodes,
+                 llvm::ArrayRef<DyldSegment> Segments, bool Lazy,
+                 llvm::function_ref<bool(const DyldBind &)> Func);
+
+} // namespace ipasim
+
+// !defined(IPASIM_DYLD_INFO_HPP)
+#endif
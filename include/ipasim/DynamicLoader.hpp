@@ -5,16 +5,23 @@
 #define IPASIM_DYNAMIC_LOADER_HPP
 
 #include "ipasim/Common.hpp"
+#include "ipasim/DyldInfo.hpp"
 #include "ipasim/Emulator.hpp"
+#include "ipasim/LaunchClosure.hpp"
 #include "ipasim/LoadedLibrary.hpp"
 #include "ipasim/Logger.hpp"
+#include "ipasim/SymbolIndex.hpp"
 #include "ipasim/TextBlockStream.hpp"
 
+#include <atomic>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <stack>
 #include <string>
 #include <unicorn/unicorn.h>
+#include <unordered_map>
 #include <vector>
 
 namespace ipasim {
@@ -35,6 +42,13 @@ struct LibraryInfo {
   LoadedLibrary *Lib;
 };
 
+// Symbol nearest to some address (see `DynamicLoader::symbolize`).
+struct SymbolInfo {
+  LibraryInfo LI;
+  const char *Name;
+  uint64_t Offset; // Offset of the address from the symbol
+};
+
 // Used for dyld-objc integration.
 using _dyld_objc_notify_mapped = void (*)(unsigned count,
                                           const char *const paths[],
@@ -44,10 +58,22 @@ using _dyld_objc_notify_unmapped = void (*)(const char *path, const void *mh);
 
 // Represents our dynamic loader. It tries to resemble the behavior of iOS's
 // `dyld`. The dynamic loader retains information about loaded libraries.
+// Like `dyld`, it can be used from multiple threads, but it serializes them
+// using one recursive lock (see `lock`).
 class DynamicLoader {
 public:
   DynamicLoader(Emulator &Emu);
+  // Must be held when using `LoadedLibrary`s directly (e.g., calling their
+  // `findSymbol`). Public methods of `DynamicLoader` take it themselves.
+  std::unique_lock<std::recursive_mutex> lock() {
+    return std::unique_lock<std::recursive_mutex>(Mutex);
+  }
   LoadedLibrary *load(const std::string &Path);
+  // Reads launch closure (see `LaunchClosure`) of app `MainBinary`. Libraries
+  // loaded after this is called will use and update it.
+  void openClosure(const std::string &MainBinary);
+  // Saves the launch closure opened by `openClosure` if it has been updated.
+  void saveClosure();
   // Used for dyld-objc integration. Notifies registered listeners that a new
   // library was loaded into memory. Objective-C runtime uses this to initialize
   // the library's classes.
@@ -58,12 +84,71 @@ public:
                        _dyld_objc_notify_unmapped Unmapped);
   // Finds a library that `Addr` is mapped inside.
   LibraryInfo lookup(uint64_t Addr);
+  // Finds the last symbol at or before `Addr` in the library that `Addr` is
+  // mapped inside. Currently works only for Dylibs.
+  bool symbolize(uint64_t Addr, SymbolInfo &Info);
+  // Contains names of symbols and libraries referenced by `LoadedDylib`s.
+  StringPool &getStrings() { return Strings; }
   // Logging helpers
   LogStream::Handler dumpAddr(uint64_t Addr);
   LogStream::Handler dumpAddr(uint64_t Addr, const LibraryInfo &LI);
   LogStream::Handler dumpAddr(uint64_t Addr, const LibraryInfo &LI,
                               ObjCMethod M);
   uint64_t getKernelAddr() { return KernelAddr; }
+  // If enabled, imports that resolve into executable code of DLLs are bound to
+  // generated stubs that execute `svc #Idx; bx lr` (see `createSvcStub`)
+  // instead of directly to the DLL (which is mapped as non-executable, so
+  // calling it causes a fetch-protection fault). Affects only libraries loaded
+  // after this is set.
+  void setSvcDispatch(bool Enable) { UseSvcStubs = Enable; }
+  bool isSvcDispatch() { return UseSvcStubs; }
+  // Returns address of a stub calling `Target` via `svc`.
+  uint64_t createSvcStub(uint64_t Target);
+  uint64_t bindSymbol(uint64_t SymAddr, LaunchClosure::BindKind Kind,
+                      LoadedLibrary *Lib);
+  // Returns target of `svc` stub with index `Idx` (or 0 if there is none).
+  // Doesn't need the loader lock, `SvcTargets` are append-only.
+  uint64_t getSvcTarget(uint32_t Idx) {
+    return Idx < SvcTargetCount.load(std::memory_order_acquire)
+               ? SvcTargets[Idx]
+               : 0;
+  }
+  // Fills and maps part of a segment containing `Addr` if it was deferred until
+  // first access (see `DemandPaging`). Returns `false` if there is none.
+  bool mapDeferred(uint64_t Addr);
+  // Determines whether `Addr` lies in segment `__TEXT` of some loaded image.
+  // Such memory never changes, since images are never unloaded.
+  bool isImageText(uint64_t Addr);
+  // Returns address of the emulated `dyld_stub_binder` (see `bindLazySymbol`)
+  // or 0 if no image has imported it yet.
+  uint64_t getStubBinder() { return StubBinder; }
+  // Binds lazy pointer described by lazy binding info at `Offset` in image
+  // containing `Cache` (these are what stub helpers push before calling
+  // `dyld_stub_binder`). Returns the bound address (or 0 on error).
+  uint64_t bindLazySymbol(uint64_t Cache, uint32_t Offset);
+  // If enabled, imports of `_objc_msgSend` are bound to an emulated messenger
+  // (see `createMsgSend`) which looks up methods in a guest-side cache and
+  // jumps to them directly, so that message sends between emulated classes
+  // never leave the emulator. Affects only libraries loaded after this is set.
+  void setGuestMessenger(bool Enable) { UseGuestMsgSend = Enable; }
+  bool isGuestMessenger() { return UseGuestMsgSend; }
+  // Invalidates all entries of the guest-side method caches. Must be called
+  // after method implementations change outside of emulated code.
+  void flushMsgCache() {
+    if (MsgEpoch)
+      ++*MsgEpoch;
+  }
+  // Returns guest-side method cache for a new thread context, or 0 if the
+  // guest messenger is disabled (then messengers never use the cache in that
+  // context). Each thread has its own cache, since entries are not updated
+  // atomically. The messenger finds it in register `TPIDRURO`.
+  uint64_t allocateMsgCache();
+  // Returns cache allocated by `allocateMsgCache` for reuse. Its entries stay
+  // valid, they are invalidated only by `flushMsgCache`.
+  void releaseMsgCache(uint64_t Cache);
+  // Incremented every time a new library is loaded. Caches derived from
+  // loaded libraries use this to detect when they should be invalidated.
+  size_t getGeneration() { return Generation; }
   static constexpr uint64_t alignToPageSize(uint64_t Addr) {
     return Addr & (-PageSize);
   }
@@ -80,17 +165,119 @@ private:
     _dyld_objc_notify_unmapped Unmapped;
   };
 
+  // Part of a segment filled on first access (see `mapDeferred`).
+  struct DeferredChunk {
+    uint64_t Addr, Size;
+    uint64_t FileOffset; // In `File`
+    uc_prot Perms;
+    std::shared_ptr<const uint8_t> File; // View of the whole file
+  };
+  // Mach-O image being loaded by `loadMachO`.
+  struct MachOJob {
+    BinaryPath BP;
+    const LaunchClosure::Record *Replay; // Non-null if replaying
+    LaunchClosure::Record Rec;           // Recorded if `Recording`
+    bool Recording;
+    bool Bound;  // `true` iff `bindMachO` has been called
+    bool Failed; // `true` iff the image can't be loaded (see `Errors`)
+    std::unique_ptr<LIEF::MachO::FatBinary> Fat;
+    LIEF::MachO::Binary *Bin;
+    uint64_t Slide;
+    void *Memory;      // Holds the segments (see `releaseMachO`)
+    bool MappedFile;   // `true` iff `Memory` is a view of the file
+    void *Reservation; // Reserved in front of the view (see `mapMachO`)
+    uint64_t SliceOffset;                // Offset of `Bin` in the file
+    std::vector<DyldSegment> Segments;   // Slid, in order of load commands
+    std::vector<DeferredChunk> Deferred; // In order of segments
+    std::vector<std::string> Errors;     // Reported after `prepareMachO`
+    std::vector<std::string> Deps;       // Names of referenced libraries
+    std::vector<MachOJob *> DepJobs;     // Mach-O images among `Deps`
+    LoadedDylib *LL;
+    // Source of `Deferred` chunks (see `mapDeferred`)
+    std::shared_ptr<const uint8_t> FileView;
+  };
+
   bool canSegmentsSlide(LIEF::MachO::Binary &Bin);
   BinaryPath resolvePath(const std::string &Path);
-  LoadedLibrary *loadMachO(const std::string &Path);
+  void initLibrary(LoadedLibrary *L, const BinaryPath &BP);
+  LoadedLibrary *loadMachO(const BinaryPath &BP);
+  void prepareMachO(MachOJob &Job);
+  void releaseMachO(MachOJob &Job);
+  void deferChunks(MachOJob &Job, LIEF::MachO::SegmentCommand &Seg,
+                   const std::vector<uint64_t> &Rebases);
+  void mapSegments(MachOJob &Job);
+  void bindMachO(MachOJob &Job);
+  bool mapMachO(MachOJob &Job, uint64_t LowAddr, uint64_t HighAddr,
+                uint64_t &Slide);
+  static uint64_t getSliceOffset(const void *File);
   LoadedLibrary *loadPE(const std::string &Path);
+  void hookMutators(HMODULE Lib);
   void handleMachOs(size_t HdrOffset, size_t HandlerOffset);
 
-  static constexpr int R_SCATTERED = 0x80000000; // From `<mach-o/reloc.h>`
+  bool isHostCode(uint64_t Addr);
+  uint32_t *allocateCode(size_t Size);
+  bool createMsgEpoch();
+  uint64_t createMsgSend(uint64_t Fallback, uint64_t Lookup);
+  uint64_t createFlushThunk(uint64_t Target);
+  uint64_t createStubBinder();
+  static LaunchClosure::BindKind getBindKind(const std::string &SymName);
+  // Adds library's address range into index used by `lookup`.
+  void indexRange(const std::string &Path);
+
+  static constexpr uint32_t FatMagic = 0xCAFEBABE; // From `<mach-o/fat.h>`
+  static constexpr int AllocGranularity = 0x10000; // Of `VirtualAlloc`
+  static constexpr uint64_t DeferredChunkSize = 16 * PageSize;
+  static constexpr uint32_t SvcInsn = 0xEF000000;  // `svc #0` (ARM encoding)
+  static constexpr uint32_t BxLrInsn = 0xE12FFF1E; // `bx lr` (ARM encoding)
+  static constexpr size_t SvcStubSize = 8;         // `svc #Idx; bx lr`
+  static constexpr uint32_t MaxSvcStubs = 0x10000; // Less than `1 << 24`
+  // `svc #0xFFFFFF` (recognized by its address, see `getStubBinder`)
+  static constexpr uint32_t StubBinderInsn = 0xEFFFFFFF;
+  static constexpr uint32_t UdfInsn = 0xE7F000F0; // `udf #0` (ARM encoding)
+  // Guest-side method cache used by the emulated messenger. Entries are valid
+  // only if their `Epoch` matches `MsgEpoch`.
+  struct MsgCacheEntry {
+    uint32_t Class, Sel, Imp, Epoch;
+  };
+  static constexpr size_t MsgCacheSize = 4096; // Number of `Entries`
+  struct MsgCacheTy {
+    MsgCacheEntry Entries[MsgCacheSize];
+  };
   Emulator &Emu;
   uint64_t KernelAddr;
+  // These are used for `svc`-based dispatch (see `setSvcDispatch`):
+  bool UseSvcStubs;
+  // Stub index -> target address (allocated with capacity `MaxSvcStubs`, so
+  // that it's never reallocated while other threads read it)
+  std::unique_ptr<uint64_t[]> SvcTargets;
+  std::atomic<uint32_t> SvcTargetCount; // Published after the target is set
+  std::unordered_map<uint64_t, uint64_t> SvcStubs; // Target -> stub address
+  // These are used for the guest messenger (see `setGuestMessenger`):
+  bool UseGuestMsgSend;
+  std::atomic<uint32_t> *MsgEpoch; // Shared by all threads' caches
+  std::vector<uint64_t> FreeMsgCaches; // See `releaseMsgCache`
+  std::unordered_map<uint64_t, uint64_t> MsgSends;    // Fallback -> messenger
+  std::unordered_map<uint64_t, uint64_t> FlushThunks; // Target -> thunk
+  uint64_t StubBinder; // See `getStubBinder`
+  // Generated code (see `allocateCode`) is placed into these chunks (of size
+  // `AllocGranularity`):
+  uint32_t *CodeChunk;  // Chunk with free space
+  size_t CodeChunkUsed; // Bytes used in `CodeChunk`
+  std::atomic<size_t> Generation; // See `getGeneration`.
+  std::recursive_mutex Mutex;      // See `lock`.
+  // Number of Mach-O images loaded and how many of them didn't slide
+  size_t LoadedImages, UnslidImages;
+  StringPool Strings;
+  LaunchClosure Closure;
+  std::string ClosureFile; // Empty if `Closure` is not used
   // Loaded libraries and their paths
   std::map<std::string, std::unique_ptr<LoadedLibrary>> LLs;
+  // Paths of Mach-O images that failed to load (they are not tried again)
+  std::set<std::string> Unavailable;
+  // Chunks not yet filled (see `mapDeferred`) by their addresses
+  std::map<uint64_t, DeferredChunk> DeferredChunks;
+  // Address ranges of `LLs` sorted by start address (see `lookup`)
+  std::vector<std::pair<uint64_t, LibraryInfo>> Ranges;
   // These are used for dyld-objc integration:
   std::vector<const void *> Hdrs; // Registered headers
   std::set<uintptr_t> HdrSet;     // Set of registered headers for faster lookup
@@ -3,6 +3,8 @@
 #ifndef IPASIM_EMULATOR_HPP
 #define IPASIM_EMULATOR_HPP
 
+#include <cstdint>
+#include <map>
 #include <unicorn/unicorn.h>
 #include <utility>
 
@@ -36,18 +38,39 @@ struct FunctionHelper<T, RetTy(ArgTys...)> {
 class Emulator {
 public:
   Emulator(DynamicLoader &Dyld)
-      : UC(initUC()), Dyld(Dyld), IgnoreError(false) {}
+      : UC(initUC()), Dyld(Dyld), IgnoreError(false), Synced(0) {}
   Emulator(const Emulator &) = delete;
   Emulator(Emulator &&E)
-      : UC(nullptr), Dyld(E.Dyld), IgnoreError(E.IgnoreError) {
+      : UC(nullptr), Dyld(E.Dyld), IgnoreError(E.IgnoreError),
+        Regions(std::move(E.Regions)), Synced(E.Synced) {
     std::swap(UC, E.UC);
   }
   ~Emulator();
 
   uint32_t readReg(uc_arm_reg RegId);
   void writeReg(uc_arm_reg RegId, uint32_t Value);
-  void mapMemory(uint64_t Addr, uint64_t Size, uc_prot Perms);
-  void start(uint64_t Addr);
+  // Batch versions of `readReg` and `writeReg`. At most `MaxBatch` registers
+  // can be accessed at once.
+  void readRegs(const uc_arm_reg *RegIds, uint32_t *Values, size_t Count);
+  void writeRegs(const uc_arm_reg *RegIds, const uint32_t *Values,
+                 size_t Count);
+  // Maps memory into all engines (guest memory is the host's address space, so
+  // each thread's engine maps the same ranges). Can be called from any thread.
+  // Engines apply the mapping in `sync`. Parts of the range that are already
+  // mapped get the new permissions.
+  static void mapMemory(uint64_t Addr, uint64_t Size, uc_prot Perms);
+  // Maps the whole committed host allocation containing `Addr` (e.g., a heap
+  // arena) and syncs. Returns `false` if there is none.
+  bool mapHostRegion(uint64_t Addr, uc_prot Perms);
+  // Applies mappings made by `mapMemory` since the last call. Must be called
+  // from the thread using this engine. Returns `false` if there were none.
+  bool sync();
+  size_t getRegionCount() { return Regions.size(); }
+  // Determines whether `Addr` is mapped as executable in this engine.
+  bool isExecutable(uint64_t Addr);
+  // Starts emulation at `Addr`. If `Until` is non-zero, emulation stops
+  // (without an error) when it reaches that address.
+  void start(uint64_t Addr, uint64_t Until = 0);
   void stop();
   template <typename F>
   void hook(uc_hook_type Type, F *Handler, void *Instance) {
@@ -62,10 +85,30 @@ public:
   // Won't report the next error.
   void ignoreNextError();
 
+  static constexpr size_t MaxBatch = 16;
+  // Registers used to pass arguments (in this order)
+  static constexpr uc_arm_reg ArgRegs[] = {UC_ARM_REG_R0, UC_ARM_REG_R1,
+                                           UC_ARM_REG_R2, UC_ARM_REG_R3};
+
 private:
+  // Memory mapped into the emulator
+  struct Region {
+    uint64_t End;
+    uc_prot Perms;
+  };
+
   uc_engine *UC;
   DynamicLoader &Dyld;
   bool IgnoreError;
+  std::map<uint64_t, Region> Regions; // Start address -> region
+  size_t Synced; // Number of shared mappings applied by `sync`
+
+  void mapRange(uint64_t Addr, uint64_t End, uc_prot Perms,
+                bool Override);
+  void mapRegion(uint64_t Start, uint64_t End, uc_prot Perms);
+  void protectRegion(std::map<uint64_t, Region>::iterator R, uint64_t Start,
+                     uint64_t End, uc_prot Perms);
+  bool mapPtr(uint64_t Start, uint64_t End, uc_prot Perms);
 
   static uc_engine *initUC();
   static void callUCStatic(uc_err Err);
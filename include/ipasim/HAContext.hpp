@@ -64,9 +64,13 @@ using DLLPtr = size_t;
 
 // Represents one of our system `.dll`s.
 struct DLLEntry {
-  DLLEntry(std::string Name) : Name(Name) {}
+  DLLEntry(std::string Name, bool NoCallbacks = false)
+      : Name(Name), NoCallbacks(NoCallbacks) {}
 
   std::string Name;
+  // `true` iff the DLL's functions never call back into emulated code unless
+  // they are given a function pointer (see `ExportEntry::Leaf`).
+  bool NoCallbacks;
   std::vector<ExportPtr> Exports;
   ExportPtr ReferenceSymbol;
 };
@@ -92,7 +96,7 @@ struct ExportEntry {
         DylibType(nullptr), DLLType(nullptr), ObjCMethod(false),
         Messenger(false), Stret(false), Super(false), Super2(false),
         DylibStretOnly(false), UnhandledMessenger(false),
-        UnhandledVararg(false) {}
+        UnhandledVararg(false), Leaf(false) {}
 
   std::string Name;
   mutable ExportStatus Status;
@@ -105,6 +109,9 @@ struct ExportEntry {
   mutable bool DylibStretOnly : 1; // See i28.
   mutable bool UnhandledMessenger : 1;
   mutable bool UnhandledVararg : 1;
+  // `true` iff the function cannot call back into emulated code, so it can be
+  // called directly from within emulator hooks. See `WrapperIndex::Leaves`.
+  mutable bool Leaf : 1;
   mutable GroupPtr DLLGroup;
   mutable DLLPtr DLL;
   mutable DylibPtr Dylib; // First Dylib that implements this function
@@ -156,16 +163,24 @@ struct ClassExport {
 // Context of `HeadersAnalyzer`.
 class HAContext {
 public:
+  HAContext() : NextImageBase(FirstImageBase) {}
+
   ExportList iOSExps;
   DylibList iOSLibs;
   ClassExportList iOSClasses;
   GroupList DLLGroups;
+  // Preferred address of the next generated Dylib. Dylibs are laid out without
+  // overlaps, so that `DynamicLoader` doesn't have to rebase them.
+  uint64_t NextImageBase;
 
   // Messengers-related constants
   static constexpr ConstexprString MsgSendPrefix = "_objc_msgSend";
   static constexpr ConstexprString StretPostfix = "_stret";
   static constexpr ConstexprString MsgLookupPrefix = "_objc_msgLookup";
   static constexpr ConstexprString MsgNilPrefix = "__objc_msgNil";
+  // Layout of generated Dylibs (see `NextImageBase`)
+  static constexpr uint64_t FirstImageBase = 0x40000000;
+  static constexpr uint64_t ImageAlignment = 0x10000;
 
   bool isClassMethod(const std::string &Name);
   // This is an inverse of `CGObjCCommonMac::GetNameForMethod`.
@@ -178,6 +193,8 @@ public:
   // Like `isInteresting` but used when the symbol is found in a DLL.
   bool isInterestingForWindows(const std::string &Name, ExportPtr &Exp,
                                uint32_t RVA, bool IgnoreDuplicates = false);
+  // Moves `NextImageBase` after Dylib `Path` which has just been linked.
+  void reserveImage(const std::string &Path);
   ExportPtr addExport(std::string &&Name) {
     return iOSExps.insert(ExportEntry(move(Name))).first;
   };
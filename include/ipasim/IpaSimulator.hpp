@@ -24,6 +24,7 @@ public:
   Emulator Emu;
   DynamicLoader Dyld;
   std::string MainBinary;
+  TypeCache Types;
   SysTranslator Sys;
   TextBlockProvider LogText;
 };
@@ -27,6 +27,64 @@ constexpr bool PrintMemoryWrites = IPASIM_PRINT_MEMORY_WRITES;
 #endif
 constexpr bool PrintEmuInfo = IPASIM_PRINT_EMU_INFO;
 
+// If enabled, emulation returning to the kernel stops cleanly at the kernel
+// address passed as `until` to Unicorn. Otherwise, the kernel page is mapped
+// as non-executable and returns are caught as fetch-protection faults.
+#if !defined(IPASIM_RETURN_VIA_UNTIL)
+#define IPASIM_RETURN_VIA_UNTIL 1
+#endif
+constexpr bool ReturnViaUntil = IPASIM_RETURN_VIA_UNTIL;
+
+// Default value of `DynamicLoader::setSvcDispatch`.
+#if !defined(IPASIM_SVC_DISPATCH)
+#define IPASIM_SVC_DISPATCH 0
+#endif
+constexpr bool SvcDispatch = IPASIM_SVC_DISPATCH;
+
+// Default value of `DynamicLoader::setGuestMessenger`.
+#if !defined(IPASIM_GUEST_MSG_SEND)
+#define IPASIM_GUEST_MSG_SEND 0
+#endif
+constexpr bool GuestMsgSend = IPASIM_GUEST_MSG_SEND;
+
+// If enabled, results of loading Mach-O images are cached across launches (see
+// `LaunchClosure`).
+#if !defined(IPASIM_LAUNCH_CLOSURES)
+#define IPASIM_LAUNCH_CLOSURES 1
+#endif
+constexpr bool LaunchClosures = IPASIM_LAUNCH_CLOSURES;
+
+// If enabled, lazy pointers of Mach-O images are bound on first use (see
+// `DynamicLoader::bindLazySymbol`) instead of at load time.
+#if !defined(IPASIM_LAZY_BINDING)
+#define IPASIM_LAZY_BINDING 1
+#endif
+constexpr bool LazyBinding = IPASIM_LAZY_BINDING;
+
+// If enabled, code of Mach-O images that cannot be mapped directly from their
+// files is read from the files on first access by the emulator (see
+// `DynamicLoader::mapDeferred`) instead of at load time.
+#if !defined(IPASIM_DEMAND_PAGING)
+#define IPASIM_DEMAND_PAGING 0
+#endif
+constexpr bool DemandPaging = IPASIM_DEMAND_PAGING;
+
+// If enabled, Mach-O images are parsed, mapped and rebased on multiple threads
+// (see `DynamicLoader::loadMachO`).
+#if !defined(IPASIM_PARALLEL_LOADING)
+#define IPASIM_PARALLEL_LOADING 1
+#endif
+constexpr bool ParallelLoading = IPASIM_PARALLEL_LOADING;
+
+// Number of execution contexts (engines with stacks and hooks) prepared in the
+// background for threads that start executing guest code later, e.g., worker
+// threads of `libdispatch` (see `SysTranslator::prewarmContexts`). Contexts of
+// finished threads are reused up to the same limit. Zero disables pooling.
+#if !defined(IPASIM_CONTEXT_POOL_SIZE)
+#define IPASIM_CONTEXT_POOL_SIZE 4
+#endif
+constexpr size_t ContextPoolSize = IPASIM_CONTEXT_POOL_SIZE;
+
 } // namespace ipasim
 
 // !defined(IPASIM_IPA_SIMULATOR_CONFIG_HPP)
@@ -20,6 +20,8 @@ public:
   void addDylibArgs(llvm::StringRef Output, llvm::StringRef ObjectFile,
                     llvm::StringRef InstallName);
   void reexportLibrary(llvm::StringRef Name);
+  // Sets preferred load address of the Dylib.
+  void setImageBase(uint64_t Base);
   void linkDylib(llvm::StringRef Output, llvm::StringRef ObjectFile,
                  llvm::StringRef InstallName);
   void executeArgs();
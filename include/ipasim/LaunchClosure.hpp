@@ -0,0 +1,76 @@
+// LaunchClosure.hpp: Definition of class `LaunchClosure`.
+
+#ifndef IPASIM_LAUNCH_CLOSURE_HPP
+#define IPASIM_LAUNCH_CLOSURE_HPP
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ipasim {
+
+// Remembers results of loading Mach-O images (i.e., their layout, rebases and
+// resolved bindings), so that `DynamicLoader` can replay them on later launches
+// instead of computing them again. Inspired by `dyld3`'s launch closures.
+// Records are invalidated when content of any of the involved binaries changes.
+class LaunchClosure {
+public:
+  // How the bound symbol should be treated by `DynamicLoader`.
+  enum class BindKind : uint8_t {
+    Normal,
+    MsgSend,
+    MsgCacheMutator,
+    StubBinder
+  };
+  struct Bind {
+    uint32_t Offset;       // Virtual address of the bound pointer
+    uint32_t Target;       // Id of the library containing the symbol
+    uint32_t TargetOffset; // Offset of the symbol from `StartAddress`
+    BindKind Kind;
+  };
+  struct Record {
+    uint64_t LowAddr, HighAddr;    // Bounds of segments (before sliding)
+    std::vector<uint32_t> Deps;    // Libraries to load before binding
+    std::vector<uint32_t> Rebases; // Offsets (from `LowAddr`) to slide
+    std::vector<Bind> Binds;
+  };
+
+  LaunchClosure() : Dirty(false) {}
+
+  bool read(const std::string &File);
+  bool write(const std::string &File);
+  bool isDirty() { return Dirty; }
+  // Returns record of image `Path` if it's still valid. The record stays valid
+  // while other records are added.
+  const Record *find(const std::string &Path);
+  void add(const std::string &Path, Record &&R);
+  // Returns id of binary `Path` (which must have been loaded).
+  uint32_t getId(const std::string &Path);
+  std::string getPath(uint32_t Id) { return Images[Id].Path; }
+
+private:
+  enum class HashState : uint8_t { Unknown, Valid, Invalid };
+  struct Image {
+    std::string Path;
+    uint64_t Hash;
+    HashState State;
+    bool HasRecord;
+    Record R;
+  };
+
+  bool validate(uint32_t Id);
+  static uint64_t hashFile(const std::string &Path);
+
+  static constexpr uint32_t Magic = 0x43535049; // "IPSC"
+  static constexpr uint32_t Version = 3;
+  std::deque<Image> Images; // So that references to records stay valid
+  std::unordered_map<std::string, uint32_t> Ids; // Path -> index in `Images`
+  bool Dirty; // `true` iff there are changes not yet written
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_LAUNCH_CLOSURE_HPP)
+#endif
@@ -6,76 +6,83 @@
 #include "ipasim/Common.hpp"
 #include "ipasim/Logger.hpp"
 #include "ipasim/MachO.hpp"
+#include "ipasim/SymbolIndex.hpp"
 
 #include <LIEF/LIEF.hpp>
 #include <Windows.h>
 #include <cassert>
+#include <unordered_map>
+#include <vector>
 
 namespace ipasim {
 
 class DynamicLoader;
 
-// Iterator over symbols of LIEF's Mach-O binary filtered by a RVA.
-class DylibSymbolIterator {
-public:
-  DylibSymbolIterator(uint64_t RVA, LIEF::MachO::it_exported_symbols Symbols)
-      : RVA(RVA), Symbols(std::move(Symbols)) {}
-
-  DylibSymbolIterator begin();
-  DylibSymbolIterator end() { return DylibSymbolIterator(RVA, Symbols.end()); }
-  DylibSymbolIterator &next();
-  DylibSymbolIterator IPASIM_PREFIX(++);
-  bool operator!=(const DylibSymbolIterator &Other);
-  LIEF::MachO::Symbol &operator*();
-
-private:
-  uint64_t RVA;
-  LIEF::MachO::it_exported_symbols Symbols;
-};
-
 // Represents a dynamic library (or executable) loaded by `DynamicLoader`.
 class LoadedLibrary {
 public:
-  LoadedLibrary() : StartAddress(0), Size(0), IsWrapper(false) {}
+  LoadedLibrary()
+      : StartAddress(0), LowAddress(0), Size(0), IsWrapper(false) {}
   virtual ~LoadedLibrary() = default;
 
-  uint64_t StartAddress, Size;
+  // Addresses inside the library are relative to `StartAddress` (which is the
+  // slide for `.dylib`s). The library occupies `Size` bytes from `LowAddress`.
+  uint64_t StartAddress, LowAddress, Size;
   bool IsWrapper;
+  ObjCMethodIndex MethodIndex; // Used by `MachO` returned from `getMachO`
 
   virtual bool isDylib() = 0;
   bool isDLL() { return !isDylib(); }
-  // TODO: Check that the found symbol is inside range [StartAddress, +Size].
+  // TODO: Check that the found symbol is inside range [LowAddress, +Size].
   virtual uint64_t findSymbol(DynamicLoader &DL, const std::string &Name) = 0;
+  // Finds symbol `Name` with leading underscore (i.e., Mach-O style).
+  uint64_t findPrefixedSymbol(DynamicLoader &DL, const std::string &Name);
   virtual bool hasUnderscorePrefix() = 0;
   bool isInRange(uint64_t Addr);
-  void checkInRange(uint64_t Addr);
+  // Logs an error and returns `false` if `Addr` is out of range.
+  bool checkInRange(uint64_t Addr);
   virtual bool hasMachO() = 0;
   virtual MachO getMachO() = 0;
 };
 
-// A `.dylib` loaded via library LIEF.
+// A `.dylib` loaded via library LIEF. Only metadata needed at runtime are kept,
+// LIEF's representation of the binary is released after loading.
 class LoadedDylib : public LoadedLibrary {
 public:
-  LIEF::MachO::Binary &Bin;
+  struct Dependency {
+    const char *Name; // Interned in `DynamicLoader::getStrings`
+    bool ReExport;
+  };
+
+  LoadedDylib(LIEF::MachO::Binary &Bin, StringPool &Strings);
 
-  LoadedDylib(std::unique_ptr<LIEF::MachO::FatBinary> &&Fat)
-      : Fat(move(Fat)), Bin(Fat->at(0)), Header(0) {}
+  uint64_t Entrypoint; // Before sliding (or 0 if there is none)
+  // Referenced libraries in order of their load commands (so that they can be
+  // indexed by ordinals).
+  std::vector<Dependency> Dependencies;
 
   bool isDylib() override { return true; }
   uint64_t findSymbol(DynamicLoader &DL, const std::string &Name) override;
+  // Returns symbols at `Addr`.
   // TODO: Use this function to implement `src/objc/dladdr.mm`.
-  DylibSymbolIterator lookup(uint64_t Addr);
+  SymbolIndex::EntryRange lookup(uint64_t Addr) {
+    return SymIndex.findExact(Addr - StartAddress);
+  }
+  const SymbolIndex &getSymbolIndex() { return SymIndex; }
   bool hasUnderscorePrefix() override { return true; }
   bool hasMachO() override { return true; }
   MachO getMachO() override {
-    if (!Header)
-      Header = StartAddress + Bin.imagebase();
-    return MachO(reinterpret_cast<const void *>(Header));
+    return MachO(reinterpret_cast<const void *>(StartAddress + ImageBase),
+                 &MethodIndex);
   }
 
 private:
-  std::unique_ptr<LIEF::MachO::FatBinary> Fat;
-  uint64_t Header;
+  uint64_t ImageBase;
+  // Results of `findSymbol` (including negative ones)
+  std::unordered_map<std::string, uint64_t> Symbols;
+  SymbolIndex SymIndex;
+
+  uint64_t resolveSymbol(DynamicLoader &DL, const std::string &Name);
 };
 
 // A `.dll` loaded via Windows API.
@@ -86,11 +93,12 @@ public:
 
   bool isDylib() override { return false; }
   uint64_t findSymbol(DynamicLoader &DL, const std::string &Name) override;
+  uint64_t findSymbol(const char *Name);
   bool hasUnderscorePrefix() override { return false; }
   bool hasMachO() override { return MachOPoser; }
   MachO getMachO() override {
     assert(hasMachO());
-    return MachO(reinterpret_cast<const void *>(StartAddress));
+    return MachO(reinterpret_cast<const void *>(StartAddress), &MethodIndex);
   }
 };
 
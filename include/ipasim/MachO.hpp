@@ -3,10 +3,13 @@
 #ifndef IPASIM_MACHO_HPP
 #define IPASIM_MACHO_HPP
 
+#include "ipasim/DyldInfo.hpp"
 #include "ipasim/Logger.hpp"
 
+#include <atomic>
 #include <cstdint>
 #include <type_traits>
+#include <unordered_map>
 
 namespace ipasim {
 
@@ -38,6 +41,7 @@ public:
   ObjCClass getClass() { return ObjCClass(Category, ClassData); }
   const char *getName();
   const char *getType();
+  uint64_t getImp();
 
   operator bool() { return MethodData; }
 
@@ -63,12 +67,44 @@ std::enable_if_t<is_stream_v<StreamTy>, StreamTy> &operator<<(StreamTy &Str,
   return Str;
 }
 
+// Reverse index from method implementations (IMPs) to methods of one Mach-O
+// image. It's built lazily by `MachO::findMethod` and rebuilt when the
+// Objective-C runtime changes the image's metadata (i.e., realizes its classes
+// or attaches categories to them).
+class ObjCMethodIndex {
+public:
+  ObjCMethodIndex() : Valid(false), Generation(0) {}
+
+  // Forces the index to be rebuilt on next use.
+  void invalidate() { Valid = false; }
+  // Must be called whenever the runtime realizes a class. Indices built before
+  // are then rebuilt when a lookup misses.
+  static void classRealized() { ++Realizations; }
+
+private:
+  friend class MachO;
+
+  static std::atomic<uint64_t> Realizations;
+
+  bool Valid;
+  uint64_t Generation; // Value of `Realizations` when the index was built
+  std::unordered_map<uint64_t, ObjCMethod> Methods;
+};
+
+// Symbol exported by a Mach-O image (see `MachO::findExport`).
+struct MachOExport {
+  uint64_t Addr;          // Zero if the symbol is re-exported
+  uint32_t Ordinal;       // Library the symbol is re-exported from (1-based)
+  const char *ImportName; // Name in that library (empty if it's the same)
+};
+
 // Helper class for reading sections, especially Objective-C-related, by
 // analyzing Mach-O headers. Note that the Mach-O binary being analyzed must be
 // loaded in memory at runtime (cf. class `ObjCMethodScout`).
 class MachO {
 public:
-  MachO(const void *Hdr) : Hdr(Hdr) {}
+  MachO(const void *Hdr, ObjCMethodIndex *Index = nullptr)
+      : Hdr(Hdr), Index(Index) {}
 
   static constexpr const char *DataSegment = "__DATA";
 
@@ -86,12 +122,22 @@ public:
   }
   uint64_t getSection(const char *SegName, const char *SectName,
                       uint64_t *Size = nullptr);
+  uint64_t getSegment(const char *SegName, uint64_t *Size = nullptr);
   ObjCMethod findMethod(uint64_t Addr);
+  // Looks up symbol `Name` in the image's export trie.
+  bool findExport(const char *Name, MachOExport &Export);
+  // Decodes lazy binding info at `Offset` (as passed by stub helpers to
+  // `dyld_stub_binder`).
+  bool findLazyBind(uint32_t Offset, DyldBind &Bind);
 
 private:
   const void *Hdr;
+  ObjCMethodIndex *Index;
 
   ObjCMethod findMethod(const char *Section, uint64_t Addr);
+  ObjCMethod findMethodSlow(uint64_t Addr);
+  const uint8_t *getDyldInfo(bool Lazy, uint64_t &Size);
+  void buildIndex();
 };
 
 } // namespace ipasim
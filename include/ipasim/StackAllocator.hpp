@@ -0,0 +1,48 @@
+// StackAllocator.hpp: Definition of class `StackAllocator`.
+
+#ifndef IPASIM_STACK_ALLOCATOR_HPP
+#define IPASIM_STACK_ALLOCATOR_HPP
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace ipasim {
+
+// Allocates guest stacks. Each stack is reserved in the host's address space
+// with a guard below it and its pages are committed (and mapped into
+// emulators) only as the stack grows (see `grow`). Native code accessing the
+// stack directly grows it through a vectored exception handler. Released
+// stacks are kept for reuse, so their mappings in emulators never become
+// dangling.
+class StackAllocator {
+public:
+  struct Stack {
+    uint64_t Low, High; // Usable range (i.e., without the guard)
+    uint64_t Committed; // Lowest committed (and mapped) address
+  };
+  enum class GrowResult { NotStack, Grown, Overflow };
+
+  StackAllocator();
+  Stack *allocate(size_t Size);
+  void release(Stack *S);
+  // Makes `Addr` accessible if it lies inside some stack.
+  GrowResult grow(uint64_t Addr);
+
+private:
+  static constexpr size_t Granularity = 0x10000; // Of `VirtualAlloc`
+  static constexpr size_t GuardSize = Granularity;
+  static constexpr size_t CommitChunk = Granularity;
+
+  std::mutex Mutex;
+  // All stacks keyed by starts of their reservations (i.e., their guards)
+  std::map<uint64_t, std::unique_ptr<Stack>> Stacks;
+  std::vector<Stack *> Free;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_STACK_ALLOCATOR_HPP)
+#endif
@@ -0,0 +1,63 @@
+// SymbolIndex.hpp: Definition of classes `StringPool` and `SymbolIndex`.
+
+#ifndef IPASIM_SYMBOL_INDEX_HPP
+#define IPASIM_SYMBOL_INDEX_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+namespace ipasim {
+
+// Storage of unique strings. Returned pointers stay valid for the lifetime of
+// the pool.
+class StringPool {
+public:
+  StringPool() : BlockUsed(BlockSize) {}
+
+  const char *intern(std::string_view S);
+
+private:
+  static constexpr size_t BlockSize = 64 * 1024;
+  std::vector<std::unique_ptr<char[]>> Blocks;
+  size_t BlockUsed; // Bytes used in the last block of `Blocks`
+  std::unordered_set<std::string_view> Strings;
+};
+
+// Symbols of one image sorted by their addresses (relative to the image's
+// `StartAddress`) and by their names. Names are stored in a `StringPool`.
+class SymbolIndex {
+public:
+  struct Entry {
+    uint32_t RVA;
+    const char *Name;
+  };
+  struct EntryRange {
+    const Entry *Begin, *End;
+
+    const Entry *begin() const { return Begin; }
+    const Entry *end() const { return End; }
+    bool empty() const { return Begin == End; }
+  };
+
+  void add(uint32_t RVA, const char *Name) { Entries.push_back({RVA, Name}); }
+  // Must be called after all symbols have been `add`ed.
+  void finish();
+  // Returns all symbols at `RVA`.
+  EntryRange findExact(uint32_t RVA) const;
+  // Returns the last symbol at or before `RVA` (or `nullptr` if there is none).
+  const Entry *findPreceding(uint32_t RVA) const;
+  // Returns the first symbol named `Name` (or `nullptr` if there is none).
+  const Entry *findByName(const char *Name) const;
+
+private:
+  std::vector<Entry> Entries;
+  std::vector<uint32_t> ByName; // Indices into `Entries` sorted by names
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_SYMBOL_INDEX_HPP)
+#endif
@@ -1,26 +1,38 @@
-// SysTranslator.hpp: Definition of classes `SysTranslator`, `DynamicCaller`,
-// `DynamicBackCaller` and `TypeDecoder`.
+// SysTranslator.hpp: Definition of classes `SysTranslator`, `DynamicCaller`
+// and `DynamicBackCaller`.
 
 #ifndef IPASIM_SYS_TRANSLATOR_HPP
 #define IPASIM_SYS_TRANSLATOR_HPP
 
+#include "ipasim/CallPlan.hpp"
 #include "ipasim/DynamicLoader.hpp"
 #include "ipasim/Emulator.hpp"
 #include "ipasim/LoadedLibrary.hpp"
+#include "ipasim/StackAllocator.hpp"
 
+#include <atomic>
 #include <ffi.h>
+#include <iterator>
+#include <llvm/ADT/SmallVector.h>
+#include <memory>
+#include <mutex>
 #include <stack>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 namespace ipasim {
 
 // Represents the layer in our emulator that translates function calls between
 // the host (native libraries) and the guest (emulated libraries). It also
-// controls the whole execution in order to be able to do its job.
+// controls the whole execution in order to be able to do its job. Each host
+// thread that executes guest code gets its own execution context (see
+// `getContext`), so guest code can run in multiple threads at once.
 class SysTranslator {
 public:
-  SysTranslator(DynamicLoader &Dyld, Emulator &Emu)
-      : Dyld(Dyld), Emu(Emu), Restart(false), Continue(false),
-        RestartFromLRs(false) {}
+  SysTranslator(DynamicLoader &Dyld, Emulator &Emu, TypeCache &Types)
+      : Dyld(Dyld), Emu(Emu), Types(Types), MainContextTaken(false),
+        TranslationGeneration(0), Stats{} {}
   // Starts executing the given library loaded by our `DynamicLoader`. The
   // library is initialized before `SysTranslator` starts executing its
   // entrypoint.
@@ -36,6 +48,18 @@ public:
   // their number is specified by `ArgC`. Similarly, the function can only
   // return a 32-bit-wide value or `void` (specified by `Returns`).
   void *translate(void *FP, size_t ArgC, bool Returns = false);
+  // Statistics of the translation cache used by both `translate` overloads.
+  struct TranslationStats {
+    size_t Hits, Misses;
+    size_t Trampolines; // Number of allocated trampolines
+  };
+  TranslationStats getTranslationStats();
+  // Returns engine executing guest code in the calling thread.
+  Emulator &getEmulator() { return getContext().Emu; }
+  // Prepares execution contexts for threads that will start executing guest
+  // code later (see `ContextPoolSize`). Returns immediately, the contexts are
+  // created in the background.
+  void prewarmContexts();
   // Dynamically calls a function from a library.
   template <typename... Args>
   void call(const std::string &Lib, const std::string &Func,
@@ -61,13 +85,114 @@ public:
   template <typename... ArgTys> void *callBackR(void *FP, ArgTys... Args);
 
 private:
+  // Resolved target of a cross-boundary call (see `handleFetchProtMem`).
+  struct DispatchTarget {
+    enum KindTy {
+      WrapperDLL, // Address is inside a wrapper DLL, call it directly.
+      Wrapper,    // Address has a wrapper Dylib, `Addr` points to it.
+      Dynamic     // Objective-C method translated dynamically.
+    } Kind;
+    uint64_t Addr;
+    bool Leaf;                            // Only for `WrapperDLL`.
+    std::shared_ptr<const CallPlan> Plan; // Only for `Dynamic`.
+  };
+
+  // Native function calling emulated function `Addr` (see `createTrampoline`).
+  struct Trampoline {
+    Trampoline() : Closure(nullptr), Ptr(nullptr) {}
+    Trampoline(const Trampoline &) = delete;
+    ~Trampoline();
+
+    ffi_cif CIF;
+    bool Returns;
+    size_t ArgC;
+    uint64_t Addr;
+    ffi_closure *Closure;
+    void *Ptr; // Executable address of `Closure`
+  };
+  // Function translated by `translate` or `createTrampoline`.
+  struct TranslationKey {
+    uint64_t Addr;
+    size_t ArgC;
+    bool Returns;
+
+    bool operator==(const TranslationKey &Other) const {
+      return Addr == Other.Addr && ArgC == Other.ArgC &&
+             Returns == Other.Returns;
+    }
+  };
+  struct TranslationKeyHash {
+    size_t operator()(const TranslationKey &Key) const {
+      size_t Seed = std::hash<uint64_t>()(Key.Addr);
+      combine(Seed, std::hash<size_t>()(Key.ArgC));
+      combine(Seed, std::hash<bool>()(Key.Returns));
+      return Seed;
+    }
+    // Mixes `Hash` into `Seed` (as `boost::hash_combine` does).
+    static void combine(size_t &Seed, size_t Hash) {
+      Seed ^= Hash + 0x9e3779b9 + (Seed << 6) + (Seed >> 2);
+    }
+  };
+  // Execution state of one host thread (see `getContext`).
+  struct ThreadContext {
+    ThreadContext(Emulator &Emu)
+        : Emu(Emu), Stack(nullptr), MsgCache(0), Restart(false),
+          Continue(false), RestartFromLRs(false), RestartAddr(0),
+          ReturnedToKernel(false), DispatchGeneration(0) {}
+    ThreadContext(const ThreadContext &) = delete;
+    void reset();
+
+    std::unique_ptr<Emulator> OwnEmu; // Null if `Emu` is the main engine
+    Emulator &Emu;
+    StackAllocator::Stack *Stack;           // Allocated from `Stacks`
+    // Guest-side method cache (see `DynamicLoader::allocateMsgCache`)
+    uint64_t MsgCache;
+    std::stack<uint32_t> LRs;               // Stack of return addresses
+    bool Restart, Continue, RestartFromLRs; // See `execute(uint64_t)`.
+    uint64_t RestartAddr;                   // See `handleFetchProtMem`.
+    bool ReturnedToKernel;                  // See `handleFetchProtMem`.
+    std::function<void()> Continuation;     // See `continueOutsideEmulation`.
+    // Cache of resolved cross-boundary call targets keyed by the fetched
+    // address. It's invalidated whenever `DynamicLoader` loads a new library.
+    std::unordered_map<uint64_t, DispatchTarget> DispatchCache;
+    size_t DispatchGeneration; // `DynamicLoader::getGeneration` of the cache
+  };
+
+  // Owner of the calling thread's context. When the thread exits, secondary
+  // contexts are returned to `ContextPool`.
+  struct ContextHolder {
+    ~ContextHolder();
+
+    SysTranslator *Sys = nullptr;
+    std::unique_ptr<ThreadContext> Ctx;
+  };
+
+  // Execution contexts
+  ThreadContext &getContext();
+  std::unique_ptr<ThreadContext> acquireContext();
+  std::unique_ptr<ThreadContext> createContext(bool Main);
+  void releaseContext(std::unique_ptr<ThreadContext> &&Ctx);
+  void installHooks(Emulator &E);
   // Emulator hooks
   bool handleFetchProtMem(uc_mem_type Type, uint64_t Addr, int Size,
                           int64_t Value);
+  void handleInterrupt(uint32_t IntNo);
+  void handleStubBinder();
   void handleCode(uint64_t Addr, uint32_t Size);
   bool handleMemWrite(uc_mem_type Type, uint64_t Addr, int Size, int64_t Value);
   bool handleMemUnmapped(uc_mem_type Type, uint64_t Addr, int Size,
                          int64_t Value);
+  bool handleFetchUnmapped(uc_mem_type Type, uint64_t Addr, int Size,
+                           int64_t Value);
+  // Dispatch helpers
+  const DispatchTarget *findDispatchTarget(uint64_t Addr);
+  bool resolveDispatchTarget(uint64_t Addr, DispatchTarget &Target);
+  bool dispatch(uint64_t Addr, const DispatchTarget &Target, bool Svc);
+  bool isLeafWrapper(LoadedLibrary *WrapperLib, uint64_t Addr);
+  // Translation helpers
+  void syncTranslations();
+  void *translateMethod(void *FP);
+  void *translateFunction(void *FP, size_t ArgC, bool Returns);
   // Trampoline helpers
   void *createTrampoline(void *Addr, size_t ArgC, bool Returns);
   void handleTrampoline(void *Ret, void **Args, void *Data);
@@ -79,59 +204,61 @@ private:
   void continueOutsideEmulation(std::function<void()> &&Cont);
 
   static constexpr ConstexprString WrapsPrefix = "$__ipaSim_wraps_";
+  static constexpr ConstexprString WrapperPrefix = "$__ipaSim_wrapper_";
+  static constexpr const char *IdxSymbol = "?Idx@@3UWrapperIndex@ipasim@@A";
   // TODO: Don't hardcode this.
   static constexpr uint64_t DLLBase = 0x1000; // Standard DLL base address
+  static constexpr uint32_t ExcpSwi = 2; // `EXCP_SWI` from QEMU's ARM target
+  static constexpr uint32_t CpsrThumb = 1 << 5; // `T` bit of `CPSR`
+  static constexpr size_t MainStackSize = 8 * 1024 * 1024; // 8 MiB
+  static constexpr size_t SecondaryStackSize = 512 * 1024; // 512 KiB
   DynamicLoader &Dyld;
-  Emulator &Emu;
-  std::stack<uint32_t> LRs;               // Stack of return addresses
-  bool Restart, Continue, RestartFromLRs; // See `execute(uint64_t)`.
-  std::function<void()> Continuation;     // See `continueOutsideEmulation`.
+  Emulator &Emu; // Main engine (used by the first thread executing guest code)
+  // Decoded type encodings. Note that call plans are never deallocated, so
+  // `DispatchTarget`s can point to them.
+  TypeCache &Types;
+  std::atomic<bool> MainContextTaken; // `true` iff some thread uses `Emu`
+  StackAllocator Stacks;
+  // Secondary contexts ready to be used by new threads (see `acquireContext`)
+  std::vector<std::unique_ptr<ThreadContext>> ContextPool;
+  std::mutex PoolMutex; // Protects `ContextPool`
+  // Protects translations, trampolines and their statistics below. Note that
+  // `LeafWrappers` are protected by the loader lock instead.
+  std::mutex Mutex;
+  // Addresses of leaf wrappers (see `WrapperIndex::Leaves`) per wrapper DLL
+  std::unordered_map<LoadedLibrary *, std::unordered_set<uint64_t>>
+      LeafWrappers;
+  // Results of `translate` (see also `syncTranslations`):
+  std::unordered_map<uint64_t, void *> MethodTranslations;
+  std::unordered_map<TranslationKey, void *, TranslationKeyHash> Translations;
+  size_t TranslationGeneration;
+  TranslationStats Stats;
+  // Trampolines are never deallocated while `SysTranslator` lives, because
+  // native code can hold pointers to them. Instead, they are reused.
+  std::unordered_map<TranslationKey, std::unique_ptr<Trampoline>,
+                     TranslationKeyHash>
+      Trampolines;
 };
 
 // Represents a dynamic call from the guest (emulated) into the host (native).
 class DynamicCaller {
 public:
-  DynamicCaller(Emulator &Emu)
-      : Emu(Emu), RegId(UC_ARM_REG_R0), SP(Emu.readReg(UC_ARM_REG_SP)) {}
-  void loadArg(size_t Size);
-  bool call(bool Returns, uint32_t Addr);
+  // Reads arguments from `Emu`.
+  DynamicCaller(Emulator &Emu, const CallPlan &Plan);
+  // Calls native function `Addr` and stores its result into `Emu`.
+  void call(uint32_t Addr);
 
 private:
-  template <size_t N> void call(bool Returns, uint32_t Addr) {
-    if (Returns)
-      call<N, N, true>(Addr);
-    else
-      call<N, N, false>(Addr);
-  }
-  template <size_t N, size_t C, bool Returns, typename... ArgTys>
-  void call(uint32_t Addr, ArgTys... Params) {
-    if constexpr (N > 0)
-      call<N - 1, C, Returns, ArgTys..., uint32_t>(Addr, Params...,
-                                                   Args[C - N]);
-    else
-      call<Returns, ArgTys...>(Addr, Params...);
-  }
-  template <bool Returns, typename... ArgTys>
-  void call(uint32_t Addr, ArgTys... Params) {
-    if constexpr (Returns) {
-      uint32_t RetVal =
-          reinterpret_cast<uint32_t (*)(ArgTys...)>(Addr)(Params...);
-      Emu.writeReg(UC_ARM_REG_R0, RetVal);
-    } else
-      reinterpret_cast<void (*)(ArgTys...)>(Addr)(Params...);
-  }
-
   Emulator &Emu;
-  uc_arm_reg RegId;
-  uint32_t SP;
-  std::vector<uint32_t> Args;
+  const CallPlan &Plan;
+  llvm::SmallVector<uint32_t, 16> Words; // Argument slots
 };
 
 // Represents a dynamic call from the host (native) into the guest (emulated).
 class DynamicBackCaller {
 public:
-  DynamicBackCaller(DynamicLoader &Dyld, Emulator &Emu, SysTranslator &Sys)
-      : Dyld(Dyld), Emu(Emu), Sys(Sys) {}
+  DynamicBackCaller(DynamicLoader &Dyld, SysTranslator &Sys)
+      : Dyld(Dyld), Sys(Sys) {}
 
   template <typename RetTy, typename... ArgTys>
   RetTy callBack(void *FP, ArgTys... Args) {
@@ -142,8 +269,10 @@ public:
       // native executable code and we can simply call it.
       return reinterpret_cast<RetTy (*)(ArgTys...)>(FP)(Args...);
     } else {
-      // Target load method is inside some emulated library.
-      pushArgs<UC_ARM_REG_R0>(Args...);
+      // Target load method is inside some emulated library. Execute it in the
+      // calling thread's engine.
+      Emulator &Emu = Sys.getEmulator();
+      pushArgs(Emu, Args...);
       Sys.execute(Addr);
 
       // Fetch return value.
@@ -153,48 +282,30 @@ public:
   }
 
 private:
-  template <uc_arm_reg RegId> void pushArgs() {}
-  template <uc_arm_reg RegId, typename... ArgTys>
-  void pushArgs(void *Arg, ArgTys... Args) {
-    using namespace ipasim;
-
-    static_assert(UC_ARM_REG_R0 <= RegId && RegId <= UC_ARM_REG_R3,
+  template <typename... ArgTys> void pushArgs(Emulator &Emu, ArgTys... Args) {
+    static_assert(sizeof...(ArgTys) <= std::size(Emulator::ArgRegs),
                   "Callback has too many arguments.");
-    Emu.writeReg(RegId, reinterpret_cast<uint32_t>(Arg));
-    pushArgs<RegId + 1>(Args...);
+    if constexpr (sizeof...(ArgTys) > 0) {
+      uint32_t Values[] = {reinterpret_cast<uint32_t>(Args)...};
+      Emu.writeRegs(Emulator::ArgRegs, Values, sizeof...(ArgTys));
+    }
   }
 
   DynamicLoader &Dyld;
-  Emulator &Emu;
   SysTranslator &Sys;
   std::vector<uint32_t> Args;
 };
 
-// Helper class for decoding Objective-C's type encodings.
-class TypeDecoder {
-public:
-  TypeDecoder(const char *T) : T(T) {}
-  size_t getNextTypeSize();
-  bool hasNext() { return *T; }
-
-  static const size_t InvalidSize = static_cast<size_t>(-1);
-
-private:
-  const char *T;
-
-  size_t getNextTypeSizeImpl();
-};
-
 // Implemented here because both definitions of `SysTranslator` and
 // `DynamicBackCaller` are needed.
 template <typename... ArgTys>
 inline void SysTranslator::callBack(void *FP, ArgTys... Args) {
-  DynamicBackCaller(Dyld, Emu, *this).callBack<void, ArgTys...>(FP, Args...);
+  DynamicBackCaller(Dyld, *this).callBack<void, ArgTys...>(FP, Args...);
 }
 template <typename... ArgTys>
 inline void *SysTranslator::callBackR(void *FP, ArgTys... Args) {
-  return DynamicBackCaller(Dyld, Emu, *this)
-      .callBack<void *, ArgTys...>(FP, Args...);
+  return DynamicBackCaller(Dyld, *this).callBack<void *, ArgTys...>(FP,
+                                                                   Args...);
 }
 
 } // namespace ipasim
@@ -5,6 +5,7 @@
 
 #include <cstdint>
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -17,6 +18,10 @@ struct WrapperIndex {
   std::vector<std::string> Dylibs;
   // Map from original DLL RVA to wrapper Dylib index
   std::map<uint32_t, uint32_t> Map;
+  // Original DLL RVAs of functions that cannot call back into emulated code.
+  // Their wrappers (named `$__ipaSim_wrapper_<RVA>`) can be called directly
+  // from emulator hooks.
+  std::set<uint32_t> Leaves;
 };
 
 } // namespace ipasim
@@ -118,6 +118,45 @@ void DLLHelper::load(LLDBHelper &LLDB, ClangHelper &Clang, CodeGenModule *CGM) {
   }
 }
 
+// Determines whether a value of type `T` can contain a function pointer.
+static bool hasFunctionPointer(Type *T, set<Type *> &Visited) {
+  if (!Visited.insert(T).second)
+    return false;
+  if (T->isFunctionTy())
+    return true;
+  if (auto *PT = dyn_cast<PointerType>(T))
+    return hasFunctionPointer(PT->getElementType(), Visited);
+  if (auto *AT = dyn_cast<ArrayType>(T))
+    return hasFunctionPointer(AT->getElementType(), Visited);
+  if (auto *ST = dyn_cast<StructType>(T))
+    for (Type *ElementTy : ST->elements())
+      if (hasFunctionPointer(ElementTy, Visited))
+        return true;
+  return false;
+}
+
+// Determines whether function `Name` of type `T` from a DLL that doesn't call
+// back on its own (see `DLLEntry::NoCallbacks`) could call back into emulated
+// code.
+static bool mayCallBack(const string &Name, FunctionType *T) {
+  // These don't take function pointers, but they run handlers registered
+  // earlier (via `atexit`, `at_quick_exit` or `signal`) or don't return at all,
+  // so they must never be called from within emulator hooks.
+  static const set<string> Denylist{"_abort", "_exit", "__exit", "__Exit",
+                                    "_quick_exit", "_raise", "_longjmp"};
+  if (Denylist.count(Name))
+    return true;
+  if (T->isVarArg())
+    return true;
+  set<Type *> Visited;
+  if (hasFunctionPointer(T->getReturnType(), Visited))
+    return true;
+  for (Type *ParamTy : T->params())
+    if (hasFunctionPointer(ParamTy, Visited))
+      return true;
+  return false;
+}
+
 void DLLHelper::generate(const DirContext &DC, bool Debug) {
   IRHelper IR(LLVM, DLL.Name, DLLPath.string(), IRHelper::Windows32);
   IRHelper DylibIR(LLVM, DLL.Name, DLLPath.string(), IRHelper::Apple);
@@ -147,6 +186,11 @@ void DLLHelper::generate(const DirContext &DC, bool Debug) {
     if (!Exp->getDLLType() || Exp->Messenger)
       continue;
 
+    // Find out whether the function can be called directly from emulator
+    // hooks.
+    Exp->Leaf = DLL.NoCallbacks && !Exp->ObjCMethod &&
+                !mayCallBack(Exp->Name, Exp->getDLLType());
+
     // Declarations.
     Function *Func =
         Exp->ObjCMethod ? nullptr : IR.declareFunc<LibType::DLL>(*Exp);
@@ -298,6 +342,11 @@ void DLLHelper::generate(const DirContext &DC, bool Debug) {
         OS << "MAP(0x" << std::hex << Exp.RVA << ", " << Dylibs[Exp.Dylib]
            << ");\n";
 
+    // List leaf functions.
+    for (const ExportEntry &Exp : deref(DLL.Exports))
+      if (Exp.Leaf)
+        OS << "LEAF(0x" << std::hex << Exp.RVA << ");\n";
+
     OS << "END\n";
     OS.flush();
   }
@@ -6,7 +6,10 @@
 #include "ipasim/HeadersAnalyzer/Config.hpp"
 #include "ipasim/Output.hpp"
 
+#include <algorithm>
 #include <llvm/ADT/Twine.h>
+#include <llvm/Object/MachO.h>
+#include <llvm/Support/MathExtras.h>
 
 using namespace ipasim;
 using namespace llvm;
@@ -36,6 +39,37 @@ template <LibType T> llvm::FunctionType *ExportEntry::getType() const {
 template llvm::FunctionType *ExportEntry::getType<LibType::Dylib>() const;
 template llvm::FunctionType *ExportEntry::getType<LibType::DLL>() const;
 
+void HAContext::reserveImage(const string &Path) {
+  using namespace llvm::object;
+
+  auto File(ObjectFile::createObjectFile(Path));
+  if (!File) {
+    Log.error() << toString(File.takeError()) << " (" << Path << ")"
+                << Log.end();
+    return;
+  }
+  auto *Obj = dyn_cast<MachOObjectFile>(File->getBinary());
+  if (!Obj) {
+    Log.error() << "expected Mach-O (" << Path << ")" << Log.end();
+    return;
+  }
+
+  // Reserve the image's size in memory (which can be bigger than on disk,
+  // e.g., because of zero-fill sections).
+  uint64_t LowAddr = UINT64_MAX, HighAddr = 0;
+  for (const MachOObjectFile::LoadCommandInfo &Cmd : Obj->load_commands()) {
+    if (Cmd.C.cmd != MachO::LC_SEGMENT)
+      continue;
+    MachO::segment_command Seg = Obj->getSegmentLoadCommand(Cmd);
+    if (!Seg.vmsize)
+      continue;
+    LowAddr = min<uint64_t>(LowAddr, Seg.vmaddr);
+    HighAddr = max<uint64_t>(HighAddr, Seg.vmaddr + Seg.vmsize);
+  }
+  if (LowAddr < HighAddr)
+    NextImageBase += alignTo(HighAddr - LowAddr, ImageAlignment);
+}
+
 bool HAContext::isClassMethod(const string &Name) {
   return (Name[0] == '+' || Name[0] == '-') && Name[1] == '[';
 }
@@ -124,9 +124,12 @@ public:
       // Prebuilt `libdispatch.dll`
       HAC.DLLGroups[I++].DLLs.push_back(DLLEntry("libdispatch.dll"));
 
-      // C runtime
+      // C runtime. Other DLLs are not marked `NoCallbacks`, because even
+      // functions like `CFRetain` or `NSString` accessors can end up sending
+      // messages to objects whose classes are emulated.
       HAC.DLLGroups[I++].DLLs.push_back(
-          DLLEntry(Debug ? "ucrtbased.dll" : "ucrtbase.dll"));
+          DLLEntry(Debug ? "ucrtbased.dll" : "ucrtbase.dll",
+                   /* NoCallbacks */ true));
     }
   }
   void parseAppleHeaders() {
@@ -351,6 +354,7 @@ public:
       // Initialize LLD args to create the Dylib.
       LLDHelper LLD(DC.BuildDir, LLVM);
       LLD.addDylibArgs(DylibPath.string(), ObjectFile, Lib.Name);
+      LLD.setImageBase(HAC.NextImageBase);
       LLD.Args.add(("-L" + DC.OutputDir.string()).c_str());
 
       // Add DLLs to link.
@@ -379,6 +383,7 @@ public:
 
       // Link the Dylib.
       LLD.executeArgs();
+      HAC.reserveImage(DylibPath.string());
     }
 
     if constexpr (SumUnimplementedFunctions & LibType::DLL)
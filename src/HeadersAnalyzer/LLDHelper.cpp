@@ -5,6 +5,7 @@
 #include "ipasim/Output.hpp"
 
 #include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringExtras.h>
 #include <llvm/Support/Program.h>
 #include <string>
 #include <vector>
@@ -47,6 +48,10 @@ void LLDHelper::reexportLibrary(llvm::StringRef Name) {
   Args.add("-reexport_library");
   Args.add(Name.data());
 }
+void LLDHelper::setImageBase(uint64_t Base) {
+  Args.add("-image_base");
+  Args.add(("0x" + utohexstr(Base)).c_str());
+}
 void LLDHelper::linkDylib(StringRef Output, StringRef ObjectFile,
                           StringRef InstallName) {
   addDylibArgs(Output, ObjectFile, InstallName);
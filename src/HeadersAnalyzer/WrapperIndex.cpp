@@ -13,6 +13,7 @@ __declspec(dllexport) WrapperIndex Idx;
 
 #define ADD_LIBRARY(path) Idx.Dylibs.push_back(path)
 #define MAP(dll, dylib) Idx.Map[dll] = dylib
+#define LEAF(dll) Idx.Leaves.insert(dll)
 #define END }
 
 WrapperIndex::WrapperIndex() {
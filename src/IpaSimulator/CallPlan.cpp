@@ -0,0 +1,544 @@
+// CallPlan.cpp: Implementation of classes `TypeDecoder`, `CallPlan` and
+// `TypeCache`.
+
+#include "ipasim/CallPlan.hpp"
+
+#include "ipasim/IpaSimulator.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+constexpr uint32_t alignTo(uint32_t Value, uint32_t Align) {
+  return (Value + Align - 1) / Align * Align;
+}
+
+// Fills `L` if `C` encodes a scalar type.
+bool decodeScalar(char C, TypeLayout &L) {
+  auto Set = [&L](TypeLayout::KindTy Kind, uint32_t Size, ffi_type *FFIType) {
+    L.Kind = Kind;
+    L.Size = Size;
+    // In APCS, nothing is aligned to more than 4 bytes.
+    L.Align = Size ? min(Size, 4u) : 1;
+    L.IntegerLike = Kind == TypeLayout::Integer;
+    L.FFIType = FFIType;
+    L.Leaves.clear();
+    return true;
+  };
+
+  switch (C) {
+  case 'v': // void
+    return Set(TypeLayout::Void, 0, &ffi_type_void);
+  case 'c': // char (and `BOOL`)
+    return Set(TypeLayout::Integer, 1, &ffi_type_sint8);
+  case 'C': // unsigned char
+  case 'B': // bool
+    return Set(TypeLayout::Integer, 1, &ffi_type_uint8);
+  case 's': // short
+    return Set(TypeLayout::Integer, 2, &ffi_type_sint16);
+  case 'S': // unsigned short
+    return Set(TypeLayout::Integer, 2, &ffi_type_uint16);
+  case 'i': // int
+  case 'l': // long
+    return Set(TypeLayout::Integer, 4, &ffi_type_sint32);
+  case 'I': // unsigned int
+  case 'L': // unsigned long
+  case '@': // id
+  case '#': // Class
+  case ':': // SEL
+  case '*': // char *
+  case '%': // atom
+    return Set(TypeLayout::Integer, 4, &ffi_type_uint32);
+  case 'q': // long long
+    return Set(TypeLayout::Integer, 8, &ffi_type_sint64);
+  case 'Q': // unsigned long long
+    return Set(TypeLayout::Integer, 8, &ffi_type_uint64);
+  case 'f': // float
+    return Set(TypeLayout::Float, 4, &ffi_type_float);
+  case 'd': // double
+  case 'D': // long double (which is `double` on armv7)
+    return Set(TypeLayout::Float, 8, &ffi_type_double);
+  default:
+    return false;
+  }
+}
+
+// Integer of the given size used to fill unions (which `ffi_type` cannot
+// describe).
+ffi_type *getUnitType(uint32_t Size) {
+  switch (Size) {
+  case 1:
+    return &ffi_type_uint8;
+  case 2:
+    return &ffi_type_uint16;
+  default:
+    return &ffi_type_uint32;
+  }
+}
+
+// Appends offsets of scalars in `M` placed at `Offset` into `L`.
+void appendLeaves(TypeLayout &L, const TypeLayout &M, uint32_t Offset) {
+  if (M.Kind != TypeLayout::Aggregate)
+    L.Leaves.push_back(Offset);
+  else
+    for (uint32_t Leaf : M.Leaves)
+      L.Leaves.push_back(Offset + Leaf);
+}
+
+// Collects offsets and sizes of scalars in `T` as laid out by the host.
+void collectLeaves(ffi_type *T, uint32_t Base, vector<uint32_t> &Offsets,
+                   vector<uint32_t> &Sizes) {
+  if (T->type != FFI_TYPE_STRUCT) {
+    Offsets.push_back(Base);
+    Sizes.push_back(T->size);
+    return;
+  }
+  uint32_t Offset = 0;
+  for (ffi_type **E = T->elements; *E; ++E) {
+    Offset = alignTo(Offset, (*E)->alignment);
+    collectLeaves(*E, Base + Offset, Offsets, Sizes);
+    Offset += (*E)->size;
+  }
+}
+
+} // namespace
+
+// =============================================================================
+// TypeDecoder
+// =============================================================================
+
+bool TypeDecoder::hasNext() {
+  skipQualifiers();
+  return *T;
+}
+
+bool TypeDecoder::getNextType(TypeLayout &L) {
+  skipQualifiers();
+  if (!decode(L))
+    return false;
+  // Skip offset of the argument (which can be marked as negative or
+  // register-relative in old encodings).
+  if (*T == '-' || *T == '+')
+    ++T;
+  skipDigits();
+  return true;
+}
+
+void TypeDecoder::skipQualifiers() {
+  // Type qualifiers (`const`, `in`, `inout`, `out`, `bycopy`, `byref`,
+  // `oneway`, `_Atomic` and GC-invisible).
+  while (*T && strchr("rnNoORVA!", *T))
+    ++T;
+}
+
+void TypeDecoder::skipDigits() {
+  while ('0' <= *T && *T <= '9')
+    ++T;
+}
+
+// Skips one type without decoding it (used for types that pointers point to,
+// those can be incomplete).
+bool TypeDecoder::skipType() {
+  skipQualifiers();
+  switch (*T) {
+  case '\0':
+    Log.error("type encoding ended unexpectedly");
+    return false;
+  case '^':
+    ++T;
+    return skipType();
+  case '@': {
+    TypeLayout L;
+    return decode(L);
+  }
+  case 'b': // bitfield
+    ++T;
+    skipDigits();
+    return true;
+  case '[':
+  case '{':
+  case '(': {
+    // Skip everything up to the matching bracket.
+    size_t Depth = 0;
+    do {
+      switch (*T) {
+      case '\0':
+        Log.error("type encoding ended unexpectedly");
+        return false;
+      case '[':
+      case '{':
+      case '(':
+        ++Depth;
+        break;
+      case ']':
+      case '}':
+      case ')':
+        --Depth;
+        break;
+      case '"':
+        // Skip quoted name.
+        for (++T; *T != '"'; ++T)
+          if (!*T) {
+            Log.error("type encoding ended unexpectedly");
+            return false;
+          }
+        break;
+      }
+      ++T;
+    } while (Depth);
+    return true;
+  }
+  default:
+    ++T;
+    return true;
+  }
+}
+
+bool TypeDecoder::decode(TypeLayout &L) {
+  char C = *T;
+  if (!C) {
+    Log.error("type encoding ended unexpectedly");
+    return false;
+  }
+  ++T;
+
+  if (decodeScalar(C, L)) {
+    // Skip block marker or class name of `id`.
+    if (C == '@') {
+      if (*T == '?')
+        ++T;
+      else if (*T == '"') {
+        for (++T; *T != '"'; ++T)
+          if (!*T) {
+            Log.error("type encoding ended unexpectedly");
+            return false;
+          }
+        ++T;
+      }
+    }
+    return true;
+  }
+
+  switch (C) {
+  case '^': // pointer to type
+    // The underlying type is not important.
+    return skipType() && decodeScalar('*', L);
+  case '[': // array
+    return decodeArray(L);
+  case '{': // struct
+    return decodeAggregate(L, '}', /* Union */ false);
+  case '(': // union
+    return decodeAggregate(L, ')', /* Union */ true);
+  default:
+    Log.error() << "unsupported type encoding '" << C << "'" << Log.end();
+    return false;
+  }
+}
+
+bool TypeDecoder::decodeAggregate(TypeLayout &L, char Close, bool Union) {
+  // Skip name of the aggregate.
+  for (; *T != '=' && *T != Close; ++T)
+    if (!*T) {
+      Log.error("aggregate type ended unexpectedly");
+      return false;
+    }
+
+  L.Kind = TypeLayout::Aggregate;
+  L.Size = 0;
+  L.Align = 1;
+  L.IntegerLike = true;
+  L.FFIType = nullptr;
+  L.Leaves.clear();
+
+  // Members of opaque aggregates are not known.
+  if (*T++ == Close)
+    return true;
+
+  vector<ffi_type *> Elements;
+  uint32_t Offset = 0, Bits = 0;
+  bool HadField = false;
+  // Bitfields are assumed to be stored in `int`s (that's what they usually
+  // are declared as).
+  auto FlushBits = [&]() {
+    for (; Bits; Bits -= min(Bits, 32u)) {
+      Offset = alignTo(Offset, 4);
+      L.Leaves.push_back(Offset);
+      Elements.push_back(&ffi_type_uint32);
+      Offset += 4;
+      L.Align = 4;
+    }
+  };
+
+  // Parse members recursively (note that the aggregate can be also empty).
+  while (*T != Close) {
+    if (!*T) {
+      Log.error("aggregate type ended unexpectedly");
+      return false;
+    }
+
+    // Skip member name.
+    if (*T == '"') {
+      for (++T; *T != '"'; ++T)
+        if (!*T) {
+          Log.error("aggregate type ended unexpectedly");
+          return false;
+        }
+      ++T;
+      continue;
+    }
+
+    if (*T == 'b') {
+      ++T;
+      uint32_t Width = 0;
+      for (; '0' <= *T && *T <= '9'; ++T)
+        Width = Width * 10 + (*T - '0');
+      if (Union) {
+        L.Size = max(L.Size, alignTo(Width, 32) / 8);
+        L.Align = 4;
+      } else
+        Bits += Width;
+      continue;
+    }
+
+    TypeLayout M;
+    skipQualifiers();
+    if (!decode(M))
+      return false;
+    if (M.Kind == TypeLayout::Void) {
+      Log.error("aggregate cannot contain void");
+      return false;
+    }
+    L.Align = max(L.Align, M.Align);
+
+    // In APCS, integer-like unions contain only integer-like members and
+    // integer-like structs have at most one (non-bitfield) member.
+    if (Union) {
+      L.Size = max(L.Size, M.Size);
+      L.IntegerLike &= M.IntegerLike;
+      continue;
+    }
+    L.IntegerLike &= M.IntegerLike && !HadField;
+    HadField = true;
+
+    FlushBits();
+    Offset = alignTo(Offset, M.Align);
+    if (M.Size) {
+      Elements.push_back(M.FFIType);
+      appendLeaves(L, M, Offset);
+    }
+    Offset += M.Size;
+  }
+  ++T;
+
+  if (Union) {
+    L.Size = alignTo(L.Size, L.Align);
+    for (uint32_t Unit = 0; Unit != L.Size; Unit += L.Align) {
+      Elements.push_back(getUnitType(L.Align));
+      L.Leaves.push_back(Unit);
+    }
+  } else {
+    FlushBits();
+    L.Size = alignTo(Offset, L.Align);
+  }
+  if (!Elements.empty())
+    L.FFIType = createAggregate(move(Elements));
+  return true;
+}
+
+bool TypeDecoder::decodeArray(TypeLayout &L) {
+  uint32_t Count = 0;
+  for (; '0' <= *T && *T <= '9'; ++T)
+    Count = Count * 10 + (*T - '0');
+
+  TypeLayout Elem;
+  skipQualifiers();
+  if (!decode(Elem))
+    return false;
+  if (*T != ']') {
+    Log.error("array type ended unexpectedly");
+    return false;
+  }
+  ++T;
+
+  L.Kind = TypeLayout::Aggregate;
+  L.Size = Count * Elem.Size;
+  L.Align = Elem.Align;
+  L.IntegerLike = false;
+  L.FFIType = nullptr;
+  L.Leaves.clear();
+
+  // `ffi_type` cannot describe arrays, so list the elements one by one.
+  if (Elem.Size && Count) {
+    vector<ffi_type *> Elements(Count, Elem.FFIType);
+    for (uint32_t I = 0; I != Count; ++I)
+      appendLeaves(L, Elem, I * Elem.Size);
+    L.FFIType = createAggregate(move(Elements));
+  }
+  return true;
+}
+
+ffi_type *TypeDecoder::createAggregate(vector<ffi_type *> &&Elements) {
+  Elements.push_back(nullptr);
+  vector<ffi_type *> &E = Storage.Elements.emplace_back(move(Elements));
+  ffi_type &Type = Storage.Types.emplace_back();
+  Type.type = FFI_TYPE_STRUCT;
+  Type.elements = E.data();
+
+  // Lay out the aggregate as the host does (`ffi_prep_cif` would compute the
+  // same), so that its size is known even if it's never passed to `libffi`.
+  uint32_t Size = 0, Align = 1;
+  for (ffi_type **Elem = Type.elements; *Elem; ++Elem) {
+    Size = alignTo(Size, (*Elem)->alignment) + (*Elem)->size;
+    Align = max(Align, static_cast<uint32_t>((*Elem)->alignment));
+  }
+  Type.size = alignTo(Size, Align);
+  Type.alignment = Align;
+  return &Type;
+}
+
+// =============================================================================
+// CallPlan
+// =============================================================================
+
+unique_ptr<CallPlan> CallPlan::create(const char *Encoding) {
+  unique_ptr<CallPlan> Plan(new CallPlan);
+  TypeDecoder TD(Encoding, Plan->Types);
+
+  // Handle return value. In APCS, only scalars and integer-like aggregates of
+  // up to 4 bytes are returned in registers. Others are stored into memory
+  // pointed to by the first argument.
+  TypeLayout &Ret = Plan->Ret;
+  if (!TD.getNextType(Ret))
+    return nullptr;
+  if (Ret.Kind == TypeLayout::Aggregate && !Ret.Size) {
+    Log.error("unsupported return type");
+    return nullptr;
+  }
+  Plan->IndirectRet = Ret.Kind == TypeLayout::Aggregate &&
+                      (Ret.Size > 4 || !Ret.IntegerLike);
+
+  // Assign arguments to slots. Aggregates are split into consecutive slots
+  // and, unlike in AAPCS, 64-bit values don't start at even registers.
+  uint32_t Word = Plan->IndirectRet ? 1 : 0;
+  while (TD.hasNext()) {
+    Arg A;
+    if (!TD.getNextType(A.Type))
+      return nullptr;
+    if (!A.Type.Size) {
+      Log.error("unsupported argument type");
+      return nullptr;
+    }
+    A.Word = Word;
+    A.Scratch = 0;
+    Word += alignTo(A.Type.Size, 4) / 4;
+    Plan->Args.push_back(move(A));
+  }
+  Plan->Words = Word;
+
+  if (!Plan->prepare())
+    return nullptr;
+  return Plan;
+}
+
+bool CallPlan::prepare() {
+  for (Arg &A : Args)
+    ArgTypes.push_back(A.Type.FFIType);
+  if (ffi_prep_cif(&CIF, FFI_MS_CDECL, ArgTypes.size(), Ret.FFIType,
+                   ArgTypes.data()) != FFI_OK) {
+    Log.error("couldn't prepare CIF");
+    return false;
+  }
+
+  // Reserve scratch space for aggregates that must be copied between the
+  // layouts.
+  ScratchSize = 0;
+  auto Reserve = [this](size_t Size) {
+    uint32_t Offset = alignTo(ScratchSize, sizeof(uint64_t));
+    ScratchSize = Offset + Size;
+    return Offset;
+  };
+  for (Arg &A : Args)
+    if (computeMoves(A.Type, A.Moves))
+      A.Scratch = Reserve(A.Type.FFIType->size);
+  // Results returned in registers are always stored into the scratch space
+  // (which must be big enough for `ffi_arg`).
+  RetScratch = 0;
+  if (!IndirectRet || computeMoves(Ret, RetMoves))
+    RetScratch = Reserve(max(Ret.FFIType->size, sizeof(uint64_t)));
+  return true;
+}
+
+// Returns `true` if layout of aggregate `L` is different on the host.
+bool CallPlan::computeMoves(const TypeLayout &L, vector<Move> &Moves) {
+  if (L.Kind != TypeLayout::Aggregate)
+    return false;
+
+  vector<uint32_t> Offsets, Sizes;
+  collectLeaves(L.FFIType, 0, Offsets, Sizes);
+  assert(Offsets.size() == L.Leaves.size());
+
+  bool Differs = L.FFIType->size != L.Size;
+  for (size_t I = 0, E = Offsets.size(); I != E; ++I) {
+    Moves.push_back(Move{L.Leaves[I], Offsets[I], Sizes[I]});
+    Differs |= L.Leaves[I] != Offsets[I];
+  }
+  if (!Differs)
+    Moves.clear();
+  return Differs;
+}
+
+// =============================================================================
+// TypeCache
+// =============================================================================
+
+shared_ptr<const CallPlan> TypeCache::getCallPlan(const char *Encoding) {
+  return lookup(Plans, Encoding, &CallPlan::create);
+}
+
+shared_ptr<const TypeLayout> TypeCache::getType(const char *Encoding) {
+  shared_ptr<DecodedType> Result =
+      lookup(Types, Encoding, [](const char *Encoding) {
+        auto Result = make_unique<DecodedType>();
+        TypeDecoder TD(Encoding, Result->Types);
+        if (!TD.getNextType(Result->Layout))
+          Result.reset();
+        return Result;
+      });
+  if (!Result)
+    return nullptr;
+  return shared_ptr<const TypeLayout>(Result, &Result->Layout);
+}
+
+template <typename T, typename FuncTy>
+shared_ptr<T> TypeCache::lookup(Table<T> &Tab, const char *Encoding,
+                                FuncTy Decode) {
+  unique_lock<mutex> Lock(Mutex);
+
+  // Encodings in Mach-O metadata never change. Other addresses can be reused
+  // for another encoding, so the contents are checked, too.
+  auto I = Tab.ByAddress.find(Encoding);
+  if (I != Tab.ByAddress.end() &&
+      (I->second.Immutable || I->second.Entry->first == Encoding))
+    return I->second.Entry->second;
+
+  // This takes the loader's lock, so it mustn't be called under ours.
+  Lock.unlock();
+  bool Immutable = Dyld.isImageText(reinterpret_cast<uint64_t>(Encoding));
+  Lock.lock();
+
+  if (Tab.ByContent.size() >= MaxEntries) {
+    Tab.ByAddress.clear();
+    Tab.ByContent.clear();
+  } else if (Tab.ByAddress.size() >= MaxEntries)
+    Tab.ByAddress.clear();
+  auto [It, New] = Tab.ByContent.try_emplace(Encoding);
+  if (New)
+    It->second = Decode(Encoding);
+  Tab.ByAddress[Encoding] = {&*It, Immutable};
+  return It->second;
+}
@@ -0,0 +1,225 @@
+// DyldInfo.cpp: Implementation of functions from `DyldInfo.hpp`.
+
+#include "ipasim/DyldInfo.hpp"
+
+#include <llvm/BinaryFormat/MachO.h>
+#include <llvm/Support/LEB128.h>
+
+using namespace ipasim;
+using namespace llvm;
+using namespace llvm::MachO;
+using namespace std;
+
+namespace {
+
+constexpr uint32_t PointerSize = sizeof(uint32_t);
+
+// Reads opcodes and their operands. Reading past the end sets `Error`.
+class OpcodeReader {
+public:
+  OpcodeReader(ArrayRef<uint8_t> Opcodes)
+      : P(Opcodes.begin()), End(Opcodes.end()), Error(false) {}
+
+  bool atEnd() { return P >= End; }
+  bool hasError() { return Error; }
+  uint8_t readByte() { return *P++; }
+  uint64_t readULEB() {
+    const char *ErrorMsg = nullptr;
+    unsigned Length;
+    uint64_t Result = decodeULEB128(P, &Length, End, &ErrorMsg);
+    P += Length;
+    Error |= ErrorMsg != nullptr;
+    return Result;
+  }
+  int64_t readSLEB() {
+    const char *ErrorMsg = nullptr;
+    unsigned Length;
+    int64_t Result = decodeSLEB128(P, &Length, End, &ErrorMsg);
+    P += Length;
+    Error |= ErrorMsg != nullptr;
+    return Result;
+  }
+  const char *readString() {
+    auto *Result = reinterpret_cast<const char *>(P);
+    while (P < End && *P)
+      ++P;
+    Error |= P == End;
+    ++P;
+    return Result;
+  }
+
+private:
+  const uint8_t *P, *End;
+  bool Error;
+};
+
+// Keeps track of the current address as `dyld` opcodes move it.
+class AddressTracker {
+public:
+  AddressTracker(ArrayRef<DyldSegment> Segments)
+      : Segments(Segments), Segment(nullptr), Offset(0) {}
+
+  bool setSegment(uint32_t Index, uint64_t NewOffset) {
+    if (Index >= Segments.size())
+      return false;
+    Segment = &Segments[Index];
+    Offset = NewOffset;
+    return true;
+  }
+  void advance(uint64_t Delta) { Offset += Delta; }
+  // Checks that `Count` pointers `Stride` bytes apart fit into the segment.
+  bool check(uint64_t Count, uint64_t Stride) {
+    return Segment && Count &&
+           Offset + (Count - 1) * Stride + PointerSize <= Segment->Size;
+  }
+  uint64_t getAddr() { return Segment->Addr + Offset; }
+
+private:
+  ArrayRef<DyldSegment> Segments;
+  const DyldSegment *Segment;
+  uint64_t Offset;
+};
+
+} // namespace
+
+bool ipasim::forEachRebase(
+    ArrayRef<uint8_t> Opcodes, ArrayRef<DyldSegment> Segments,
+    function_ref<void(uint64_t, uint32_t, uint32_t)> Func) {
+  OpcodeReader R(Opcodes);
+  AddressTracker Addr(Segments);
+  auto Rebase = [&](uint64_t Count, uint64_t Stride) {
+    if (!Addr.check(Count, Stride))
+      return false;
+    Func(Addr.getAddr(), Count, Stride);
+    Addr.advance(Count * Stride);
+    return true;
+  };
+
+  while (!R.atEnd() && !R.hasError()) {
+    uint8_t Byte = R.readByte();
+    uint8_t Imm = Byte & REBASE_IMMEDIATE_MASK;
+    switch (Byte & REBASE_OPCODE_MASK) {
+    case REBASE_OPCODE_DONE:
+      return true;
+    case REBASE_OPCODE_SET_TYPE_IMM:
+      // Both are plain 32-bit pointers on ARM.
+      if (Imm != REBASE_TYPE_POINTER && Imm != REBASE_TYPE_TEXT_ABSOLUTE32)
+        return false;
+      break;
+    case REBASE_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+      if (!Addr.setSegment(Imm, R.readULEB()))
+        return false;
+      break;
+    case REBASE_OPCODE_ADD_ADDR_ULEB:
+      Addr.advance(R.readULEB());
+      break;
+    case REBASE_OPCODE_ADD_ADDR_IMM_SCALED:
+      Addr.advance(Imm * PointerSize);
+      break;
+    case REBASE_OPCODE_DO_REBASE_IMM_TIMES:
+      if (!Rebase(Imm, PointerSize))
+        return false;
+      break;
+    case REBASE_OPCODE_DO_REBASE_ULEB_TIMES:
+      if (!Rebase(R.readULEB(), PointerSize))
+        return false;
+      break;
+    case REBASE_OPCODE_DO_REBASE_ADD_ADDR_ULEB:
+      if (!Rebase(1, PointerSize))
+        return false;
+      Addr.advance(R.readULEB());
+      break;
+    case REBASE_OPCODE_DO_REBASE_ULEB_TIMES_SKIPPING_ULEB: {
+      uint64_t Count = R.readULEB();
+      if (!Rebase(Count, R.readULEB() + PointerSize))
+        return false;
+      break;
+    }
+    default:
+      return false;
+    }
+  }
+  return !R.hasError();
+}
+
+bool ipasim::forEachBind(ArrayRef<uint8_t> Opcodes,
+                         ArrayRef<DyldSegment> Segments, bool Lazy,
+                         function_ref<bool(const DyldBind &)> Func) {
+  OpcodeReader R(Opcodes);
+  AddressTracker Addr(Segments);
+  DyldBind Bind{0, 0, nullptr, BIND_TYPE_POINTER, 0};
+  // Returns `false` if decoding should stop.
+  auto DoBind = [&](uint64_t Count, uint64_t Stride, bool &Stop) {
+    if (!Bind.Name || !Addr.check(Count, Stride))
+      return false;
+    for (; Count; --Count) {
+      Bind.Addr = Addr.getAddr();
+      if (!Func(Bind)) {
+        Stop = true;
+        return true;
+      }
+      Addr.advance(Stride);
+    }
+    return true;
+  };
+
+  bool Stop = false;
+  while (!R.atEnd() && !R.hasError() && !Stop) {
+    uint8_t Byte = R.readByte();
+    uint8_t Imm = Byte & BIND_IMMEDIATE_MASK;
+    switch (Byte & BIND_OPCODE_MASK) {
+    case BIND_OPCODE_DONE:
+      if (!Lazy)
+        return true;
+      break;
+    case BIND_OPCODE_SET_DYLIB_ORDINAL_IMM:
+      Bind.Ordinal = Imm;
+      break;
+    case BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB:
+      Bind.Ordinal = R.readULEB();
+      break;
+    case BIND_OPCODE_SET_DYLIB_SPECIAL_IMM:
+      // Special ordinals are negative.
+      Bind.Ordinal = Imm ? static_cast<int8_t>(BIND_OPCODE_MASK | Imm) : 0;
+      break;
+    case BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM:
+      Bind.Name = R.readString();
+      break;
+    case BIND_OPCODE_SET_TYPE_IMM:
+      Bind.Type = Imm;
+      break;
+    case BIND_OPCODE_SET_ADDEND_SLEB:
+      Bind.Addend = R.readSLEB();
+      break;
+    case BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+      if (!Addr.setSegment(Imm, R.readULEB()))
+        return false;
+      break;
+    case BIND_OPCODE_ADD_ADDR_ULEB:
+      Addr.advance(R.readULEB());
+      break;
+    case BIND_OPCODE_DO_BIND:
+      if (!DoBind(1, PointerSize, Stop))
+        return false;
+      break;
+    case BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB:
+      if (!DoBind(1, PointerSize, Stop))
+        return false;
+      Addr.advance(R.readULEB());
+      break;
+    case BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED:
+      if (!DoBind(1, PointerSize + Imm * PointerSize, Stop))
+        return false;
+      break;
+    case BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB: {
+      uint64_t Count = R.readULEB();
+      if (!DoBind(Count, R.readULEB() + PointerSize, Stop))
+        return false;
+      break;
+    }
+    default:
+      return false;
+    }
+  }
+  return !R.hasError();
+}
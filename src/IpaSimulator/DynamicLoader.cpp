@@ -6,8 +6,24 @@
 #include "ipasim/IpaSimulator.hpp"
 #include "ipasim/IpaSimulator/Config.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h> // For SSE2 intrinsics
+#endif
+#include <exception>
 #include <filesystem>
+#include <functional>
+#include <iterator>
+#include <llvm/BinaryFormat/MachO.h>
+#include <mutex>
+#include <new>
 #include <psapi.h> // For `GetModuleInformation`
+#include <thread>
+#include <utility>
 #include <winrt/Windows.ApplicationModel.h>
 #include <winrt/Windows.Storage.h>
 
@@ -17,6 +33,203 @@ using namespace winrt;
 using namespace Windows::ApplicationModel;
 using namespace Windows::Storage;
 
+namespace {
+
+// Slides `Count` pointers starting at `Addr` that are `Stride` bytes apart.
+// We actively leave NULL pointers untouched. Technically it would be correct to
+// slide them because the PAGEZERO segment slid, too. But programs probably
+// wouldn't be happy if their NULLs were non-zero.
+// TODO: Solve this as the original dyld does. Maybe by always mapping PAGEZERO
+// to address 0 or something like that.
+void slidePointers(uint64_t Addr, uint32_t Count, uint32_t Stride,
+                   uint64_t Slide) {
+  auto *P = reinterpret_cast<uint8_t *>(Addr);
+  auto Delta = static_cast<uint32_t>(Slide);
+#if defined(_M_IX86) || defined(_M_X64)
+  // Runs of adjacent pointers (e.g., from `REBASE_OPCODE_DO_REBASE_IMM_TIMES`)
+  // are slid four at a time.
+  if (Stride == sizeof(uint32_t)) {
+    __m128i DeltaV = _mm_set1_epi32(static_cast<int>(Delta));
+    __m128i Zero = _mm_setzero_si128();
+    for (; Count >= 4; Count -= 4, P += 4 * sizeof(uint32_t)) {
+      auto *V = reinterpret_cast<__m128i *>(P);
+      __m128i Val = _mm_loadu_si128(V);
+      __m128i IsNull = _mm_cmpeq_epi32(Val, Zero);
+      _mm_storeu_si128(V,
+                       _mm_add_epi32(Val, _mm_andnot_si128(IsNull, DeltaV)));
+    }
+  }
+#endif
+  for (; Count; --Count, P += Stride) {
+    auto *Val = reinterpret_cast<uint32_t *>(P);
+    if (*Val != 0)
+      *Val = *Val + Delta;
+  }
+}
+
+// Fixed set of threads which help the calling thread in `runParallel`.
+class WorkerPool {
+public:
+  WorkerPool(size_t Size) : Size(Size), Generation(0), Wanted(0), Busy(0) {
+    for (size_t I = 0; I != Size; ++I)
+      thread(&WorkerPool::work, this).detach();
+  }
+
+  // One worker per core besides the calling thread. The pool is never
+  // destroyed, since its threads couldn't be joined while the library is being
+  // unloaded.
+  static WorkerPool &get() {
+    static WorkerPool *Pool = new WorkerPool(
+        max<size_t>(thread::hardware_concurrency(), 1) - 1);
+    return *Pool;
+  }
+
+  // Runs `Func` on the calling thread and simultaneously on up to `Count`
+  // workers, then waits for the workers. Workers that don't start before the
+  // calling thread finishes are skipped, so `Func` should take its work from a
+  // shared queue.
+  void run(size_t Count, const function<void()> &Func) {
+    lock_guard<mutex> RunLock(RunMutex);
+    {
+      lock_guard<mutex> Lock(Mutex);
+      Task = &Func;
+      Wanted = min(Count, Size);
+      ++Generation;
+    }
+    Wake.notify_all();
+    Func();
+    unique_lock<mutex> Lock(Mutex);
+    Wanted = 0;
+    Done.wait(Lock, [&]() { return !Busy; });
+    Task = nullptr;
+  }
+
+private:
+  void work() {
+    uint64_t Seen = 0;
+    unique_lock<mutex> Lock(Mutex);
+    for (;;) {
+      Wake.wait(Lock, [&]() { return Wanted && Generation != Seen; });
+      Seen = Generation;
+      --Wanted;
+      ++Busy;
+      Lock.unlock();
+      (*Task)();
+      Lock.lock();
+      if (!--Busy)
+        Done.notify_one();
+    }
+  }
+
+  const size_t Size;
+  mutex RunMutex; // Serializes `run`
+  mutex Mutex;    // Guards the rest
+  condition_variable Wake, Done;
+  const function<void()> *Task;
+  uint64_t Generation; // Incremented by each `run`
+  size_t Wanted;       // Workers yet to start `Task`
+  size_t Busy;         // Workers running `Task`
+};
+
+// Calls `Func(I)` for each `I` in range [0, `Count`) using up to one thread per
+// core (including the calling one, see `WorkerPool`). The first exception
+// thrown by `Func` is rethrown after all calls finish.
+template <typename FuncTy> void runParallel(size_t Count, FuncTy Func) {
+  atomic<size_t> Next(0);
+  mutex ErrorMutex;
+  exception_ptr Error;
+  auto Worker = [&]() {
+    for (size_t I; (I = Next++) < Count;) {
+      try {
+        Func(I);
+      } catch (...) {
+        lock_guard<mutex> Lock(ErrorMutex);
+        if (!Error)
+          Error = current_exception();
+      }
+    }
+  };
+
+  if (ParallelLoading && Count > 1)
+    WorkerPool::get().run(Count - 1, Worker);
+  else
+    Worker();
+  if (Error)
+    rethrow_exception(Error);
+}
+
+uc_prot convertProtection(uint32_t VMProt) {
+  using namespace LIEF::MachO;
+
+  uc_prot Perms = UC_PROT_NONE;
+  if (VMProt & (uint32_t)VM_PROTECTIONS::VM_PROT_READ) {
+    Perms |= UC_PROT_READ;
+  }
+  if (VMProt & (uint32_t)VM_PROTECTIONS::VM_PROT_WRITE) {
+    Perms |= UC_PROT_WRITE;
+  }
+  if (VMProt & (uint32_t)VM_PROTECTIONS::VM_PROT_EXECUTE) {
+    Perms |= UC_PROT_EXEC;
+  }
+  return Perms;
+}
+
+// Maps file `Path` into memory as read-only. The view is unmapped when the last
+// reference to it is dropped.
+shared_ptr<const uint8_t> mapFile(const string &Path) {
+  HANDLE File = CreateFile2(to_hstring(Path).c_str(), GENERIC_READ,
+                            FILE_SHARE_READ, OPEN_EXISTING, nullptr);
+  if (File == INVALID_HANDLE_VALUE)
+    return nullptr;
+  HANDLE Mapping =
+      CreateFileMappingFromApp(File, nullptr, PAGE_READONLY, 0, nullptr);
+  CloseHandle(File);
+  if (!Mapping)
+    return nullptr;
+  void *View = MapViewOfFileFromApp(Mapping, FILE_MAP_READ, 0, 0);
+  // The view keeps reference to the mapping.
+  CloseHandle(Mapping);
+  if (!View)
+    return nullptr;
+  return shared_ptr<const uint8_t>(
+      reinterpret_cast<const uint8_t *>(View),
+      [](const uint8_t *V) { UnmapViewOfFile(V); });
+}
+
+// Functions that can change IMPs cached by the guest messenger.
+const char *const MsgCacheMutators[] = {
+    "class_addMethod",
+    "class_replaceMethod",
+    "class_setSuperclass",
+    "method_setImplementation",
+    "method_exchangeImplementations",
+    "objc_disposeClassPair",
+};
+constexpr size_t MutatorCount = size(MsgCacheMutators);
+
+// Native versions of flush thunks (see `DynamicLoader::hookMutators`). Mutators
+// are `__cdecl` and take at most four pointer-sized arguments, so the extra
+// ones are harmless.
+uintptr_t MutatorTargets[MutatorCount];
+template <size_t I>
+uintptr_t flushingMutator(uintptr_t A, uintptr_t B, uintptr_t C,
+                          uintptr_t D) {
+  using MutatorTy = uintptr_t (*)(uintptr_t, uintptr_t, uintptr_t, uintptr_t);
+  uintptr_t Result = reinterpret_cast<MutatorTy>(MutatorTargets[I])(A, B, C, D);
+  IpaSim.Dyld.flushMsgCache();
+  return Result;
+}
+template <size_t... Is>
+constexpr array<uintptr_t (*)(uintptr_t, uintptr_t, uintptr_t, uintptr_t),
+                MutatorCount>
+getFlushingMutators(index_sequence<Is...>) {
+  return {&flushingMutator<Is>...};
+}
+constexpr auto FlushingMutators =
+    getFlushingMutators(make_index_sequence<MutatorCount>());
+
+} // namespace
+
 bool BinaryPath::isFileValid() const {
   if (Relative) {
     return Package::Current()
@@ -33,20 +246,36 @@ bool BinaryPath::isFileValid() const {
   }
 }
 
-DynamicLoader::DynamicLoader(Emulator &Emu) : Emu(Emu) {
+DynamicLoader::DynamicLoader(Emulator &Emu)
+    : Emu(Emu), Generation(0), UseSvcStubs(SvcDispatch), SvcTargetCount(0),
+      UseGuestMsgSend(GuestMsgSend), MsgEpoch(nullptr), CodeChunk(nullptr),
+      CodeChunkUsed(AllocGranularity), StubBinder(0), LoadedImages(0),
+      UnslidImages(0) {
   // Map "kernel" page.
   void *KernelPtr =
       _aligned_malloc(DynamicLoader::PageSize, DynamicLoader::PageSize);
   KernelAddr = reinterpret_cast<uint64_t>(KernelPtr);
-  Emu.mapMemory(KernelAddr, DynamicLoader::PageSize, UC_PROT_NONE);
+  if constexpr (ReturnViaUntil) {
+    // Unicorn must be able to fetch the page in order to stop at it (see
+    // `SysTranslator::execute`). If it ever executed it, though, it would hit
+    // undefined instructions.
+    fill_n(reinterpret_cast<uint32_t *>(KernelPtr),
+           DynamicLoader::PageSize / sizeof(uint32_t), UdfInsn);
+    Emu.mapMemory(KernelAddr, DynamicLoader::PageSize,
+                  UC_PROT_READ | UC_PROT_EXEC);
+  } else
+    Emu.mapMemory(KernelAddr, DynamicLoader::PageSize, UC_PROT_NONE);
 }
 
 LoadedLibrary *DynamicLoader::load(const string &Path) {
+  auto Lock = lock();
   BinaryPath BP(resolvePath(Path));
 
   auto I = LLs.find(BP.Path);
   if (I != LLs.end())
     return I->second.get();
+  if (Unavailable.count(BP.Path))
+    return nullptr;
 
   // Check that file exists.
   if (!BP.isFileValid()) {
@@ -56,24 +285,49 @@ LoadedLibrary *DynamicLoader::load(const string &Path) {
 
   Log.info() << "loading library " << BP.Path << "...\n";
 
-  LoadedLibrary *L;
+  // Mach-O images are initialized by `loadMachO` (together with their
+  // dependencies).
   if (LIEF::MachO::is_macho(BP.Path))
-    L = loadMachO(BP.Path);
-  else if (LIEF::PE::is_pe(BP.Path))
-    L = loadPE(BP.Path);
-  else {
+    return loadMachO(BP);
+  if (!LIEF::PE::is_pe(BP.Path)) {
     Log.error() << "invalid binary type: " << BP.Path << Log.end();
     return nullptr;
   }
 
-  // Recognize wrapper libraries.
+  LoadedLibrary *L = loadPE(BP.Path);
   if (L)
-    L->IsWrapper = BP.Relative && startsWith(BP.Path, "gen\\");
-
+    initLibrary(L, BP);
   return L;
 }
 
+void DynamicLoader::initLibrary(LoadedLibrary *L, const BinaryPath &BP) {
+  // Recognize wrapper libraries.
+  L->IsWrapper = BP.Relative && startsWith(BP.Path, "gen\\");
+  ++Generation;
+}
+
+void DynamicLoader::openClosure(const string &MainBinary) {
+  if constexpr (!LaunchClosures)
+    return;
+
+  filesystem::path Folder(
+      to_string(ApplicationData::Current().LocalCacheFolder().Path()));
+  ClosureFile =
+      (Folder / (to_hex_string(hash<string>()(MainBinary)) + ".closure"))
+          .string();
+  if (!Closure.read(ClosureFile))
+    Log.info() << "no valid launch closure found in " << ClosureFile
+               << Log.end();
+}
+
+void DynamicLoader::saveClosure() {
+  if (!ClosureFile.empty() && Closure.isDirty() && !Closure.write(ClosureFile))
+    Log.error() << "couldn't write launch closure " << ClosureFile
+                << Log.end();
+}
+
 void DynamicLoader::registerMachO(const void *Hdr) {
+  auto Lock = lock();
   auto HdrPtr = reinterpret_cast<uintptr_t>(Hdr);
 
   // Do nothing if already registered.
@@ -94,6 +348,8 @@ void DynamicLoader::registerMachO(const void *Hdr) {
 }
 
 void DynamicLoader::handleMachOs(size_t HdrOffset, size_t HandlerOffset) {
+  auto Lock = lock();
+
   // Handle Dylibs in reverse order, so that dependencies are resolved first,
   // before libraries that depend on them.
   vector<const char *> Paths;
@@ -114,11 +370,17 @@ void DynamicLoader::handleMachOs(size_t HdrOffset, size_t HandlerOffset) {
       // TODO: Find out path from `LLs`.
       Handler.Init(nullptr, Hdrs[I]);
   }
+
+  // Handlers could have attached categories to classes anywhere.
+  for (auto &Pair : LLs)
+    Pair.second->MethodIndex.invalidate();
+  flushMsgCache();
 }
 
 void DynamicLoader::registerHandler(_dyld_objc_notify_mapped Mapped,
                                     _dyld_objc_notify_init Init,
                                     _dyld_objc_notify_unmapped Unmapped) {
+  auto Lock = lock();
   Handlers.push_back(MachOHandler{Mapped, Init, Unmapped});
   handleMachOs(0, Handlers.size() - 1);
 }
@@ -144,167 +406,629 @@ BinaryPath DynamicLoader::resolvePath(const string &Path) {
   return BinaryPath{Path, filesystem::path(Path).is_relative()};
 }
 
-LoadedLibrary *DynamicLoader::loadMachO(const string &Path) {
-  using namespace LIEF::MachO;
+// Loads Mach-O image `BP` together with all Mach-O images it depends on. The
+// dependency graph is discovered level by level. Images of each level are
+// parsed, mapped and rebased in parallel (see `prepareMachO`). The rest (i.e.,
+// registering the images, mapping them into the emulator and binding them) is
+// done on this thread.
+LoadedLibrary *DynamicLoader::loadMachO(const BinaryPath &BP) {
+  vector<unique_ptr<MachOJob>> Jobs;
+  unordered_map<string, MachOJob *> Pending; // Path -> job
+  auto AddJob = [&](BinaryPath &&BP) {
+    auto Job = make_unique<MachOJob>();
+    // If we have loaded this binary before, we can replay what we did then
+    // instead of doing it again. Otherwise, we record it (if we don't
+    // encounter any errors).
+    Job->Replay = ClosureFile.empty() ? nullptr : Closure.find(BP.Path);
+    Job->Recording = !ClosureFile.empty() && !Job->Replay;
+    Job->Bound = Job->Failed = false;
+    Job->Memory = Job->Reservation = nullptr;
+    Job->BP = move(BP);
+    MachOJob *JobPtr = Job.get();
+    Jobs.push_back(move(Job));
+    return Pending.emplace(JobPtr->BP.Path, JobPtr).first;
+  };
 
-  auto LL = make_unique<LoadedDylib>(Parser::parse(Path));
-  LoadedDylib *LLP = LL.get();
+  AddJob(BinaryPath(BP));
+  for (size_t Begin = 0, End; Begin != Jobs.size(); Begin = End) {
+    End = Jobs.size();
+    runParallel(End - Begin,
+                [&](size_t I) { prepareMachO(*Jobs[Begin + I]); });
 
-  // TODO: Select the correct binary more intelligently.
-  Binary &Bin = LL->Bin;
+    // Discover the next level.
+    for (size_t I = Begin; I != End; ++I) {
+      MachOJob &Job = *Jobs[I];
+      for (const string &Error : Job.Errors)
+        Log.error(Error);
+      // Other images can still be loaded without the failed one (but not
+      // without the requested one).
+      if (Job.Failed) {
+        Log.error() << "couldn't load " << Job.BP.Path << Log.end();
+        releaseMachO(Job);
+        Unavailable.insert(Job.BP.Path);
+        if (I == 0)
+          return nullptr;
+        continue;
+      }
 
-  LLs[Path] = move(LL);
+      if (Job.Replay) {
+        // These include also libraries where bound symbols were found.
+        for (uint32_t Dep : Job.Replay->Deps)
+          Job.Deps.push_back(Closure.getPath(Dep));
+      } else
+        for (LIEF::MachO::DylibCommand &Lib : Job.Bin->libraries())
+          Job.Deps.push_back(Lib.name());
+
+      for (const string &Dep : Job.Deps) {
+        BinaryPath DepBP(resolvePath(Dep));
+        auto It = Pending.find(DepBP.Path);
+        if (It == Pending.end()) {
+          // Other libraries (and invalid ones) are left for `load`.
+          if (LLs.count(DepBP.Path) || Unavailable.count(DepBP.Path) ||
+              !DepBP.isFileValid() || !LIEF::MachO::is_macho(DepBP.Path))
+            continue;
+          Log.info() << "loading library " << DepBP.Path << "...\n";
+          It = AddJob(move(DepBP));
+        }
+        Job.DepJobs.push_back(It->second);
+      }
+    }
+  }
+
+  // Register all the images, so that they can be found when binding.
+  for (auto &Job : Jobs) {
+    if (Job->Failed)
+      continue;
+    auto LL = make_unique<LoadedDylib>(*Job->Bin, Strings);
+    Job->LL = LL.get();
+    LL->StartAddress = Job->Slide;
+    LL->LowAddress = Job->Rec.LowAddr + Job->Slide;
+    LL->Size = Job->Rec.HighAddr - Job->Rec.LowAddr;
+    LLs[Job->BP.Path] = move(LL);
+    indexRange(Job->BP.Path);
+    initLibrary(Job->LL, Job->BP);
+    mapSegments(*Job);
+    if (!Job->Slide)
+      ++UnslidImages;
+    ++LoadedImages;
+  }
+  if constexpr (PrintEmuInfo)
+    Log.info() << UnslidImages << " of " << LoadedImages
+               << " Mach-O images loaded at their preferred address"
+               << Log.end();
+
+  // Bind the images in dependency order (dependencies first).
+  function<void(MachOJob &)> Bind = [&](MachOJob &Job) {
+    if (Job.Bound || Job.Failed)
+      return;
+    Job.Bound = true;
+    for (MachOJob *Dep : Job.DepJobs)
+      Bind(*Dep);
+    bindMachO(Job);
+  };
+  Bind(*Jobs.front());
+
+  // LIEF's representations of the images are released now, `LoadedDylib`s
+  // have extracted what is needed later.
+  return Jobs.front()->LL;
+}
+
+// Parses Mach-O image, maps it into memory and rebases it. This doesn't touch
+// any state shared with other images, so it can run on a worker thread. Errors
+// are collected in `Job.Errors`.
+void DynamicLoader::prepareMachO(MachOJob &Job) {
+  using namespace LIEF::MachO;
+
+  Job.Fat = Parser::parse(Job.BP.Path);
+  if (!Job.Fat || !Job.Fat->size()) {
+    Job.Errors.emplace_back("couldn't parse Mach-O binary");
+    Job.Failed = true;
+    return;
+  }
+  // TODO: Select the correct binary more intelligently.
+  Binary &Bin = Job.Fat->at(0);
+  Job.Bin = &Bin;
 
   // Check header.
   Header &Hdr = Bin.header();
   if (Hdr.cpu_type() != CPU_TYPES::CPU_TYPE_ARM)
-    Log.error("expected ARM binary");
+    Job.Errors.emplace_back("expected ARM binary");
   // Ensure that segments are continuous (required by `relocateSegment`).
   if (Hdr.has(HEADER_FLAGS::MH_SPLIT_SEGS))
-    Log.error("MH_SPLIT_SEGS not supported");
+    Job.Errors.emplace_back("MH_SPLIT_SEGS not supported");
   if (!canSegmentsSlide(Bin))
-    Log.error("the binary is not slideable");
+    Job.Errors.emplace_back("the binary is not slideable");
 
   // Compute total size of all segments. Note that in Mach-O, segments must
   // slide together (see `ImageLoaderMachO::segmentsMustSlideTogether`).
   // Inspired by `ImageLoaderMachO::assignSegmentAddresses`.
   uint64_t LowAddr = (uint64_t)(-1);
   uint64_t HighAddr = 0;
-  for (SegmentCommand &Seg : Bin.segments()) {
-    uint64_t SegLow = Seg.virtual_address();
-    // Round to page size (as required by unicorn and what even dyld does).
-    uint64_t SegHigh = roundToPageSize(SegLow + Seg.virtual_size());
-    if ((SegLow < HighAddr && SegLow >= LowAddr) ||
-        (SegHigh > LowAddr && SegHigh <= HighAddr)) {
-      Log.error("overlapping segments (after rounding to pagesize)");
-    }
-    if (SegLow < LowAddr) {
-      LowAddr = SegLow;
+  if (Job.Replay) {
+    LowAddr = Job.Replay->LowAddr;
+    HighAddr = Job.Replay->HighAddr;
+  } else
+    for (SegmentCommand &Seg : Bin.segments()) {
+      uint64_t SegLow = Seg.virtual_address();
+      // Round to page size (as required by unicorn and what even dyld does).
+      uint64_t SegHigh = roundToPageSize(SegLow + Seg.virtual_size());
+      if ((SegLow < HighAddr && SegLow >= LowAddr) ||
+          (SegHigh > LowAddr && SegHigh <= HighAddr)) {
+        Job.Errors.emplace_back(
+            "overlapping segments (after rounding to pagesize)");
+        Job.Recording = false;
+      }
+      if (SegLow < LowAddr) {
+        LowAddr = SegLow;
+      }
+      if (SegHigh > HighAddr) {
+        HighAddr = SegHigh;
+      }
     }
-    if (SegHigh > HighAddr) {
-      HighAddr = SegHigh;
+  Job.Rec.LowAddr = LowAddr;
+  Job.Rec.HighAddr = HighAddr;
+
+  // Map the segments directly from the file if possible. Otherwise, allocate
+  // space for them.
+  uint64_t Size = HighAddr - LowAddr;
+  uint64_t Slide;
+  bool Mapped = mapMachO(Job, LowAddr, HighAddr, Slide);
+  Job.MappedFile = Mapped;
+  if (!Mapped) {
+    // Prefer the address the image was linked at, so that it doesn't have to
+    // be rebased. Never place the image into the heap, though. It must be a
+    // host region of its own, otherwise touching a neighboring heap object
+    // would map it whole (see `Emulator::mapHostRegion`), including deferred
+    // chunks that haven't been filled yet.
+    uintptr_t Addr = 0;
+    if (LowAddr && LowAddr % AllocGranularity == 0)
+      Addr = (uintptr_t)VirtualAllocFromApp(reinterpret_cast<void *>(LowAddr),
+                                            Size, MEM_RESERVE | MEM_COMMIT,
+                                            PAGE_READWRITE);
+    if (!Addr)
+      Addr = (uintptr_t)VirtualAllocFromApp(
+          nullptr, Size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (!Addr) {
+      Job.Errors.emplace_back("couldn't allocate memory for segments");
+      Job.Failed = true;
+      return;
     }
+    Job.Memory = reinterpret_cast<void *>(Addr);
+    Slide = Addr - LowAddr;
   }
+  Job.Slide = Slide;
 
-  // Allocate space for the segments.
-  uint64_t Size = HighAddr - LowAddr;
-  uintptr_t Addr = (uintptr_t)_aligned_malloc(Size, PageSize);
-  if (!Addr)
-    Log.error("couldn't allocate memory for segments");
-  uint64_t Slide = Addr - LowAddr;
-  LLP->StartAddress = Slide;
-  LLP->Size = Size;
+  for (SegmentCommand &Seg : Bin.segments())
+    Job.Segments.push_back(
+        DyldSegment{Seg.virtual_address() + Slide, Seg.virtual_size()});
+
+  // Find base address for relocations. Inspired by
+  // `ImageLoaderMachOClassic::getRelocBase`.
+  uint64_t RelBase = LowAddr + Slide;
+
+  // Enumerates runs of pointers to rebase, either recorded in the closure or
+  // decoded from rebase opcodes (without materializing individual pointers).
+  auto ForEachRebase =
+      [&](llvm::function_ref<void(uint64_t, uint32_t, uint32_t)> Func) {
+        if (Job.Replay) {
+          // Group adjacent pointers back into runs.
+          const vector<uint32_t> &Offsets = Job.Replay->Rebases;
+          for (size_t I = 0, IEnd = Offsets.size(); I != IEnd;) {
+            size_t J = I + 1;
+            while (J != IEnd && Offsets[J] == Offsets[J - 1] + sizeof(uint32_t))
+              ++J;
+            Func(RelBase + Offsets[I], J - I, sizeof(uint32_t));
+            I = J;
+          }
+          return true;
+        }
+        if (!Bin.has_dyld_info())
+          return false;
+        return forEachRebase(Bin.dyld_info().rebase_opcodes(), Job.Segments,
+                             Func);
+      };
+
+  // Deferred chunks are filled from a view of the file kept while they exist
+  // (see `mapDeferred`). Find rebased addresses (relative to `LowAddr`) in
+  // advance, so that chunks containing them are not deferred (see
+  // `deferChunks`).
+  vector<uint64_t> Rebases;
+  if (DemandPaging && !Mapped)
+    Job.FileView = mapFile(Job.BP.Path);
+  if (Job.FileView) {
+    Job.SliceOffset = getSliceOffset(Job.FileView.get());
+
+    ForEachRebase([&](uint64_t Addr, uint32_t Count, uint32_t Stride) {
+      for (; Count; --Count, Addr += Stride)
+        Rebases.push_back(Addr - RelBase);
+    });
+    sort(Rebases.begin(), Rebases.end());
+  }
 
   // Load segments. Inspired by `ImageLoaderMachO::mapSegments`.
   for (SegmentCommand &Seg : Bin.segments()) {
-    // Convert protection.
-    uint32_t VMProt = Seg.init_protection();
-    uc_prot Perms = UC_PROT_NONE;
-    if (VMProt & (uint32_t)VM_PROTECTIONS::VM_PROT_READ) {
-      Perms |= UC_PROT_READ;
-    }
-    if (VMProt & (uint32_t)VM_PROTECTIONS::VM_PROT_WRITE) {
-      Perms |= UC_PROT_WRITE;
-    }
-    if (VMProt & (uint32_t)VM_PROTECTIONS::VM_PROT_EXECUTE) {
-      Perms |= UC_PROT_EXEC;
-    }
-
     uint64_t VAddr = Seg.virtual_address() + Slide;
     // Emulated virtual address is actually equal to the "real" virtual
     // address.
     uint8_t *Mem = reinterpret_cast<uint8_t *>(VAddr);
     uint64_t VSize = Seg.virtual_size();
 
-    if (Perms == UC_PROT_NONE) {
-      // No protection means we don't have to copy any data, we just map it.
-      Emu.mapMemory(VAddr, VSize, Perms);
-    } else {
-      // TODO: Memory-map the segment instead of copying it.
-      auto &Buff = Seg.content();
-      // TODO: Copy to the end of the allocated space if flag `SG_HIGHVM` is
-      // present.
-      memcpy(Mem, Buff.data(), Buff.size());
-      Emu.mapMemory(VAddr, VSize, Perms);
+    // No protection means we don't have to copy any data (see `mapSegments`).
+    if (convertProtection(Seg.init_protection()) != UC_PROT_NONE) {
+      // Mapped segments already contain their data.
+      uint64_t FileSize = Seg.file_size();
+      if (!Mapped) {
+        auto &Buff = Seg.content();
+        size_t First = Job.Deferred.size();
+        if (Job.FileView)
+          deferChunks(Job, Seg, Rebases);
+
+        // Copy everything except the deferred chunks.
+        // TODO: Copy to the end of the allocated space if flag `SG_HIGHVM` is
+        // present.
+        uint64_t Copied = 0;
+        for (size_t I = First, IEnd = Job.Deferred.size(); I != IEnd; ++I) {
+          uint64_t ChunkOffset = Job.Deferred[I].Addr - VAddr;
+          memcpy(Mem + Copied, Buff.data() + Copied, ChunkOffset - Copied);
+          Copied = ChunkOffset + Job.Deferred[I].Size;
+        }
+        memcpy(Mem + Copied, Buff.data() + Copied, Buff.size() - Copied);
+        FileSize = Buff.size();
+      }
 
       // Clear the remaining memory.
-      if (Buff.size() < VSize)
-        memset(Mem + Buff.size(), 0, VSize - Buff.size());
+      if (FileSize < VSize)
+        memset(Mem + FileSize, 0, VSize - FileSize);
     }
+  }
 
-    // Relocate addresses. Inspired by `ImageLoaderMachOClassic::rebase`.
-    if (Slide > 0) {
-      for (Relocation &Rel : Seg.relocations()) {
-        if (Rel.is_pc_relative() ||
-            Rel.origin() != RELOCATION_ORIGINS::ORIGIN_DYLDINFO ||
-            Rel.size() != 32 || (Rel.address() & R_SCATTERED) != 0)
-          Log.error("unsupported relocation");
-
-        // Find base address for this relocation. Inspired by
-        // `ImageLoaderMachOClassic::getRelocBase`.
-        uint64_t RelBase = LowAddr + Slide;
-
-        uint64_t RelAddr = RelBase + Rel.address();
-
-        // TODO: Implement what `ImageLoader::containsAddress` does.
-        if (RelAddr > VAddr + VSize || RelAddr < VAddr)
-          Log.error("relocation target out of range");
-
-        uint32_t *Val = (uint32_t *)RelAddr;
-        // We actively leave NULL pointers untouched. Technically it would be
-        // correct to slide them because the PAGEZERO segment slid, too. But
-        // programs probably wouldn't be happy if their NULLs were non-zero.
-        // TODO: Solve this as the original dyld does. Maybe by always mapping
-        // PAGEZERO to address 0 or something like that.
-        if (*Val != 0)
-          *Val = *Val + Slide;
-      }
+  // Relocate addresses. Inspired by `ImageLoaderMachOCompressed::rebase`. If
+  // the image didn't slide, relocations are needed only for recording.
+  if (Slide == 0 && !Job.Recording)
+    return;
+  bool Valid =
+      ForEachRebase([&](uint64_t Addr, uint32_t Count, uint32_t Stride) {
+        if (Job.Recording)
+          for (uint64_t I = 0; I != Count; ++I)
+            Job.Rec.Rebases.push_back(Addr + I * Stride - RelBase);
+        if (Slide != 0)
+          slidePointers(Addr, Count, Stride, Slide);
+      });
+  if (!Valid) {
+    Job.Errors.emplace_back(Bin.has_dyld_info() ? "unsupported rebase info"
+                                                : "missing rebase info");
+    Job.Recording = false;
+    Job.Failed = true;
+  }
+}
+
+// Frees memory of image prepared by `prepareMachO` that won't be loaded.
+void DynamicLoader::releaseMachO(MachOJob &Job) {
+  if (Job.Reservation)
+    VirtualFree(Job.Reservation, 0, MEM_RELEASE);
+  Job.Reservation = nullptr;
+  if (!Job.Memory)
+    return;
+  if (Job.MappedFile)
+    UnmapViewOfFile(Job.Memory);
+  else
+    VirtualFree(Job.Memory, 0, MEM_RELEASE);
+  Job.Memory = nullptr;
+}
+
+// Finds chunks of segment `Seg` that can be filled on first access. Only
+// read-only code is deferred, because host code never reads it (unlike data,
+// e.g., Objective-C metadata, which our runtime reads directly). Chunks
+// containing addresses from `Rebases` are not deferred either.
+void DynamicLoader::deferChunks(MachOJob &Job,
+                                LIEF::MachO::SegmentCommand &Seg,
+                                const vector<uint64_t> &Rebases) {
+  using namespace LIEF::MachO;
+
+  uc_prot Perms = convertProtection(Seg.init_protection());
+  if (Perms & UC_PROT_WRITE)
+    return;
+
+  // Find runs of adjacent sections containing only instructions.
+  vector<pair<uint64_t, bool>> Sections; // Start address -> is code
+  vector<pair<uint64_t, uint64_t>> Runs; // Start and end addresses
+  for (Section &Sect : Seg.sections())
+    Sections.emplace_back(
+        Sect.address(),
+        (Sect.flags() & llvm::MachO::S_ATTR_PURE_INSTRUCTIONS) != 0);
+  sort(Sections.begin(), Sections.end());
+  uint64_t SegAddr = Seg.virtual_address();
+  uint64_t DataEnd = SegAddr + Seg.content().size();
+  for (size_t I = 0, IEnd = Sections.size(); I != IEnd; ++I) {
+    if (!Sections[I].second)
+      continue;
+    uint64_t Start = Sections[I].first;
+    while (I + 1 != IEnd && Sections[I + 1].second)
+      ++I;
+    uint64_t End = I + 1 != IEnd ? Sections[I + 1].first : DataEnd;
+    Runs.emplace_back(Start, min(End, DataEnd));
+  }
+
+  // Split them into chunks (aligned relative to the segment).
+  for (auto [Start, End] : Runs) {
+    uint64_t Offset = Start - SegAddr;
+    Offset = (Offset + DeferredChunkSize - 1) / DeferredChunkSize *
+             DeferredChunkSize;
+    for (; SegAddr + Offset + DeferredChunkSize <= End;
+         Offset += DeferredChunkSize) {
+      uint64_t RebaseOffset = SegAddr + Offset - Job.Rec.LowAddr;
+      auto R = lower_bound(Rebases.begin(), Rebases.end(), RebaseOffset);
+      if (R != Rebases.end() && *R < RebaseOffset + DeferredChunkSize)
+        continue;
+      Job.Deferred.push_back(DeferredChunk{
+          SegAddr + Offset + Job.Slide, DeferredChunkSize,
+          Job.SliceOffset + Seg.file_offset() + Offset, Perms, Job.FileView});
     }
   }
+}
 
-  // Load referenced libraries. See also i22.
-  for (DylibCommand &Lib : Bin.libraries())
-    load(Lib.name());
+// Maps segments of image prepared by `prepareMachO` into the emulator. Deferred
+// chunks are left out (see `mapDeferred`).
+void DynamicLoader::mapSegments(MachOJob &Job) {
+  auto Chunk = Job.Deferred.begin();
+  for (LIEF::MachO::SegmentCommand &Seg : Job.Bin->segments()) {
+    uint64_t Start = Seg.virtual_address() + Job.Slide;
+    uint64_t Addr = Start, End = Start + Seg.virtual_size();
+    uc_prot Perms = convertProtection(Seg.init_protection());
+    for (; Chunk != Job.Deferred.end() && Chunk->Addr >= Start &&
+           Chunk->Addr < End;
+         ++Chunk) {
+      if (Chunk->Addr > Addr)
+        Emu.mapMemory(Addr, Chunk->Addr - Addr, Perms);
+      Addr = Chunk->Addr + Chunk->Size;
+      DeferredChunks[Chunk->Addr] = move(*Chunk);
+    }
+    if (Addr < End)
+      Emu.mapMemory(Addr, End - Addr, Perms);
+  }
+}
+
+bool DynamicLoader::mapDeferred(uint64_t Addr) {
+  auto Lock = lock();
+  auto I = DeferredChunks.upper_bound(Addr);
+  if (I == DeferredChunks.begin())
+    return false;
+  --I;
+  const DeferredChunk &C = I->second;
+  if (Addr >= C.Addr + C.Size)
+    return false;
+
+  if constexpr (PrintEmuInfo)
+    Log.info() << "filling deferred chunk at " << dumpAddr(C.Addr)
+               << Log.end();
+  memcpy(reinterpret_cast<void *>(C.Addr), C.File.get() + C.FileOffset, C.Size);
+  Emu.mapMemory(C.Addr, C.Size, C.Perms);
+  DeferredChunks.erase(I);
+  return true;
+}
+
+// Loads libraries image `Job` depends on and binds its external symbols.
+void DynamicLoader::bindMachO(MachOJob &Job) {
+  using namespace LIEF::MachO;
+  using namespace llvm::MachO;
+
+  // Load referenced libraries (Mach-O ones have already been loaded by
+  // `loadMachO`). See also i22.
+  for (const string &Dep : Job.Deps)
+    if (load(Dep) && Job.Recording)
+      Job.Rec.Deps.push_back(Closure.getId(resolvePath(Dep).Path));
 
   // Bind external symbols.
-  for (BindingInfo &BInfo : Bin.dyld_info().bindings()) {
+  uint64_t Slide = Job.Slide;
+  if (Job.Replay) {
+    for (const LaunchClosure::Bind &B : Job.Replay->Binds) {
+      auto I = LLs.find(Closure.getPath(B.Target));
+      if (I == LLs.end()) {
+        Log.error("symbol's library couldn't be loaded");
+        continue;
+      }
+      uint64_t Addr = B.Offset + Slide;
+      if (!Job.LL->checkInRange(Addr))
+        continue;
+      LoadedLibrary *Lib = I->second.get();
+      uint64_t SymAddr = Lib->StartAddress + B.TargetOffset;
+      *reinterpret_cast<uint32_t *>(Addr) = bindSymbol(SymAddr, B.Kind, Lib);
+    }
+    return;
+  }
+  LaunchClosure::Record &Rec = Job.Rec;
+  auto Bind = [&](const DyldBind &B) {
     // Check binding's kind.
-    if ((BInfo.binding_class() != BINDING_CLASS::BIND_CLASS_STANDARD &&
-         BInfo.binding_class() != BINDING_CLASS::BIND_CLASS_LAZY) ||
-        BInfo.binding_type() != BIND_TYPES::BIND_TYPE_POINTER ||
-        BInfo.addend()) {
+    if (B.Type != BIND_TYPE_POINTER || B.Addend) {
       Log.error("unsupported binding info");
-      continue;
-    }
-    if (!BInfo.has_library()) {
-      Log.error("flat-namespace symbols are not supported yet");
-      continue;
+      Job.Recording = false;
+      return true;
     }
 
     // Find symbol's library.
-    string LibName(BInfo.library().name());
-    LoadedLibrary *Lib = load(LibName);
+    const char *LibName;
+    if (B.Ordinal == BIND_SPECIAL_DYLIB_SELF)
+      LibName = Job.BP.Path.c_str();
+    else if (B.Ordinal > 0 &&
+             static_cast<size_t>(B.Ordinal) <= Job.LL->Dependencies.size())
+      LibName = Job.LL->Dependencies[B.Ordinal - 1].Name;
+    else {
+      Log.error("flat-namespace symbols are not supported yet");
+      Job.Recording = false;
+      return true;
+    }
+    LoadedLibrary *Lib =
+        B.Ordinal == BIND_SPECIAL_DYLIB_SELF ? Job.LL : load(LibName);
     if (!Lib) {
       Log.error("symbol's library couldn't be loaded");
-      continue;
+      Job.Recording = false;
+      return true;
     }
 
     // Find symbol's address.
-    string SymName(BInfo.symbol().name());
-    uint64_t SymAddr = Lib->findSymbol(*this, SymName);
+    uint64_t SymAddr = Lib->findSymbol(*this, B.Name);
     if (!SymAddr) {
-      Log.error() << "external symbol " << SymName << " from library "
+      Log.error() << "external symbol " << B.Name << " from library "
                   << LibName << " couldn't be resolved" << Log.end();
-      continue;
+      Job.Recording = false;
+      return true;
     }
 
     // Bind it.
-    uint64_t TargetAddr = BInfo.address() + Slide;
-    LLP->checkInRange(TargetAddr);
-    *reinterpret_cast<uint32_t *>(TargetAddr) = SymAddr;
+    Job.LL->checkInRange(B.Addr);
+    LaunchClosure::BindKind Kind = getBindKind(B.Name);
+    *reinterpret_cast<uint32_t *>(B.Addr) = bindSymbol(SymAddr, Kind, Lib);
+
+    // Remember where the symbol was found (it can be a different library than
+    // `Lib` if it's re-exported).
+    if (Job.Recording) {
+      LibraryInfo LI(lookup(SymAddr));
+      if (!LI.Lib) {
+        Job.Recording = false;
+        return true;
+      }
+      uint32_t Target = Closure.getId(*LI.LibPath);
+      if (find(Rec.Deps.begin(), Rec.Deps.end(), Target) == Rec.Deps.end())
+        Rec.Deps.push_back(Target);
+      Rec.Binds.push_back(LaunchClosure::Bind{
+          static_cast<uint32_t>(B.Addr - Slide), Target,
+          static_cast<uint32_t>(SymAddr - LI.Lib->StartAddress), Kind});
+    }
+    return true;
+  };
+  // Lazy pointers initially point to the image's stub helper which calls
+  // `dyld_stub_binder` on first use (see `bindLazySymbol`).
+  if (Job.Bin->has_dyld_info()) {
+    DyldInfo &Info = Job.Bin->dyld_info();
+    if (!forEachBind(Info.bind_opcodes(), Job.Segments, /* Lazy */ false,
+                     Bind) ||
+        (!LazyBinding && !forEachBind(Info.lazy_bind_opcodes(), Job.Segments,
+                                      /* Lazy */ true, Bind))) {
+      Log.error("invalid binding info");
+      Job.Recording = false;
+    }
   }
 
-  return LLP;
+  if (Job.Recording)
+    Closure.add(Job.BP.Path, move(Rec));
+}
+
+// Returns address that should be bound instead of `SymAddr` (found in `Lib`).
+uint64_t DynamicLoader::bindSymbol(uint64_t SymAddr,
+                                   LaunchClosure::BindKind Kind,
+                                   LoadedLibrary *Lib) {
+  using BindKind = LaunchClosure::BindKind;
+
+  if (Kind == BindKind::StubBinder)
+    return createStubBinder();
+
+  // Calls into DLLs can go through `svc` stubs instead of faulting.
+  if (UseSvcStubs && isHostCode(SymAddr))
+    SymAddr = createSvcStub(SymAddr);
+
+  // Bind messenger to its emulated version and make sure the guest-side
+  // method cache is flushed when methods are modified from emulated code.
+  if (UseGuestMsgSend) {
+    if (Kind == BindKind::MsgSend) {
+      if (uint64_t Lookup = Lib->findSymbol(*this, "_objc_msgLookup"))
+        SymAddr = createMsgSend(SymAddr, Lookup);
+    } else if (Kind == BindKind::MsgCacheMutator)
+      SymAddr = createFlushThunk(SymAddr);
+  }
+
+  return SymAddr;
+}
+
+// Maps image `Job` from its file into memory as copy-on-write, so that pages
+// which are never written to are shared with the file cache. This is possible
+// only if segments are laid out in the file the same way as in memory. Returns
+// `false` if the image couldn't be mapped. Otherwise, sets `Slide` (which is
+// zero if the image was mapped where it was linked at), `Job.Memory` and
+// `Job.Reservation`.
+bool DynamicLoader::mapMachO(MachOJob &Job, uint64_t LowAddr,
+                             uint64_t HighAddr, uint64_t &Slide) {
+  using namespace LIEF::MachO;
+
+  LIEF::MachO::Binary &Bin = *Job.Bin;
+  // Check layout of segments. Segments before the first one with file data
+  // (i.e., `__PAGEZERO`) can be left out if they are inaccessible.
+  uint64_t Delta = 0; // Virtual address of file offset 0
+  for (SegmentCommand &Seg : Bin.segments())
+    if (Seg.file_size() && !Seg.file_offset())
+      Delta = Seg.virtual_address();
+  for (SegmentCommand &Seg : Bin.segments()) {
+    if (Seg.file_size()) {
+      if (Seg.virtual_address() - Seg.file_offset() != Delta)
+        return false;
+    } else if (Seg.virtual_address() < Delta && Seg.init_protection())
+      return false;
+  }
+  uint64_t Lead = Delta - LowAddr; // Size of the left out segments
+  if (Delta < LowAddr || Lead > AllocGranularity)
+    return false;
+
+  // Map the whole file.
+  HANDLE File = CreateFile2(to_hstring(Job.BP.Path).c_str(), GENERIC_READ,
+                            FILE_SHARE_READ, OPEN_EXISTING, nullptr);
+  if (File == INVALID_HANDLE_VALUE)
+    return false;
+  LARGE_INTEGER FileSize;
+  uint32_t FatHdr[5] = {};
+  DWORD Read;
+  HANDLE Mapping = nullptr;
+  if (GetFileSizeEx(File, &FileSize) &&
+      ReadFile(File, FatHdr, sizeof(FatHdr), &Read, nullptr))
+    Mapping =
+        CreateFileMappingFromApp(File, nullptr, PAGE_WRITECOPY, 0, nullptr);
+  CloseHandle(File);
+  if (!Mapping)
+    return false;
+  uint64_t SliceOffset = getSliceOffset(FatHdr);
+
+  // Try to map the view at the address the binary was linked at first.
+  uint8_t *Mem = nullptr;
+  if (Delta > SliceOffset && (Delta - SliceOffset) % AllocGranularity == 0)
+    Mem = reinterpret_cast<uint8_t *>(MapViewOfFile3FromApp(
+        Mapping, GetCurrentProcess(),
+        reinterpret_cast<void *>(Delta - SliceOffset), 0, 0, 0, PAGE_WRITECOPY,
+        nullptr, 0));
+  if (!Mem)
+    Mem = reinterpret_cast<uint8_t *>(
+        MapViewOfFileFromApp(Mapping, FILE_MAP_COPY, 0, 0));
+  // The view keeps reference to the mapping.
+  CloseHandle(Mapping);
+  if (!Mem)
+    return false;
+
+  // Check that the image fits into the file (the rest of the last page of the
+  // view is zeroed by the system) and that memory where the left out segments
+  // would be is reserved, so that nothing else can appear there.
+  uint64_t End = SliceOffset + HighAddr - Delta;
+  void *Reservation = nullptr;
+  bool Fits = SliceOffset % PageSize == 0 &&
+              End <= roundToPageSize(FileSize.QuadPart);
+  if (Fits && SliceOffset < Lead) {
+    Reservation = VirtualAllocFromApp(Mem - AllocGranularity, AllocGranularity,
+                                      MEM_RESERVE, PAGE_NOACCESS);
+    Fits = Reservation != nullptr;
+  }
+  if (!Fits) {
+    UnmapViewOfFile(Mem);
+    return false;
+  }
+  Slide = reinterpret_cast<uint64_t>(Mem) + SliceOffset - Delta;
+  Job.Memory = Mem;
+  Job.Reservation = Reservation;
+  return true;
+}
+
+// Returns offset of the slice LIEF's `FatBinary::at(0)` is parsed from in file
+// starting with `File` (at least 20 bytes of it).
+uint64_t DynamicLoader::getSliceOffset(const void *File) {
+  auto *FatHdr = reinterpret_cast<const uint32_t *>(File);
+  if (_byteswap_ulong(FatHdr[0]) == FatMagic && _byteswap_ulong(FatHdr[1]))
+    return _byteswap_ulong(FatHdr[4]); // `fat_arch::offset`
+  return 0;
 }
 
 LoadedLibrary *DynamicLoader::loadPE(const string &Path) {
@@ -323,6 +1047,7 @@ LoadedLibrary *DynamicLoader::loadPE(const string &Path) {
     return nullptr;
   }
   LLP->Ptr = Lib;
+  hookMutators(Lib);
 
   // Find out where it lies in memory.
   MODULEINFO Info;
@@ -343,23 +1068,436 @@ LoadedLibrary *DynamicLoader::loadPE(const string &Path) {
     LLP->MachOPoser = false;
   }
 
+  LLP->LowAddress = LLP->StartAddress;
+
   // Load the library into Unicorn engine.
   uint64_t StartAddr = alignToPageSize(LLP->StartAddress);
   uint64_t Size = roundToPageSize(LLP->Size);
   Emu.mapMemory(StartAddr, Size, UC_PROT_READ | UC_PROT_WRITE);
+  indexRange(Path);
 
   return LLP;
 }
 
+// Redirects imports of `MsgCacheMutators` in DLL `Lib` to `FlushingMutators`.
+// Native code calling them doesn't go through flush thunks (see
+// `createFlushThunk`), but it can change IMPs cached by the guest messenger,
+// too.
+void DynamicLoader::hookMutators(HMODULE Lib) {
+  auto *Base = reinterpret_cast<uint8_t *>(Lib);
+  auto *Nt = reinterpret_cast<IMAGE_NT_HEADERS *>(
+      Base + reinterpret_cast<IMAGE_DOS_HEADER *>(Base)->e_lfanew);
+  IMAGE_DATA_DIRECTORY &Dir =
+      Nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+  if (!Dir.Size)
+    return;
+  auto *Desc =
+      reinterpret_cast<IMAGE_IMPORT_DESCRIPTOR *>(Base + Dir.VirtualAddress);
+  for (; Desc->Name; ++Desc) {
+    if (_stricmp(reinterpret_cast<char *>(Base + Desc->Name), "libobjc.dll") ||
+        !Desc->OriginalFirstThunk)
+      continue;
+    auto *Names =
+        reinterpret_cast<IMAGE_THUNK_DATA *>(Base + Desc->OriginalFirstThunk);
+    auto *Funcs = reinterpret_cast<IMAGE_THUNK_DATA *>(Base + Desc->FirstThunk);
+    for (; Names->u1.AddressOfData; ++Names, ++Funcs) {
+      if (IMAGE_SNAP_BY_ORDINAL(Names->u1.Ordinal))
+        continue;
+      const char *Name = reinterpret_cast<IMAGE_IMPORT_BY_NAME *>(
+                             Base + Names->u1.AddressOfData)
+                             ->Name;
+      for (size_t I = 0; I != MutatorCount; ++I) {
+        if (strcmp(Name, MsgCacheMutators[I]))
+          continue;
+        // All importers are bound to the same function.
+        MutatorTargets[I] = Funcs->u1.Function;
+        DWORD OldProtect;
+        if (!VirtualProtectFromApp(&Funcs->u1.Function,
+                                   sizeof(Funcs->u1.Function), PAGE_READWRITE,
+                                   &OldProtect)) {
+          Log.winError("couldn't hook Objective-C runtime function");
+          break;
+        }
+        Funcs->u1.Function = reinterpret_cast<uintptr_t>(FlushingMutators[I]);
+        VirtualProtectFromApp(&Funcs->u1.Function, sizeof(Funcs->u1.Function),
+                              OldProtect, &OldProtect);
+        break;
+      }
+    }
+  }
+}
+
+void DynamicLoader::indexRange(const string &Path) {
+  auto I = LLs.find(Path);
+  assert(I != LLs.end());
+  uint64_t Start = I->second->LowAddress;
+  auto Pos = upper_bound(
+      Ranges.begin(), Ranges.end(), Start,
+      [](uint64_t Addr, const auto &Range) { return Addr < Range.first; });
+  Ranges.insert(Pos, {Start, LibraryInfo{&I->first, I->second.get()}});
+}
+
+bool DynamicLoader::isImageText(uint64_t Addr) {
+  LibraryInfo LI(lookup(Addr));
+  if (!LI.Lib || !LI.Lib->hasMachO())
+    return false;
+  uint64_t Size;
+  uint64_t Text = LI.Lib->getMachO().getSegment("__TEXT", &Size);
+  return Text && Text <= Addr && Addr < Text + Size;
+}
+
+// Determines whether `Addr` points to executable code of some DLL.
+bool DynamicLoader::isHostCode(uint64_t Addr) {
+  LibraryInfo LI(lookup(Addr));
+  if (!LI.Lib || LI.Lib->isDylib())
+    return false;
+
+  // Imported symbol can also be data (e.g., an Objective-C class), so check
+  // that it lies in an executable page.
+  MEMORY_BASIC_INFORMATION Info;
+  if (!VirtualQuery(reinterpret_cast<void *>(Addr), &Info, sizeof(Info)))
+    return false;
+  return Info.Protect & (PAGE_EXECUTE | PAGE_EXECUTE_READ |
+                         PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY);
+}
+
+// Allocates `Size` bytes of memory executable by the emulator. Code is not
+// placed into heap arenas, since those can be mapped as data as a whole (see
+// `Emulator::mapHostRegion`) and then a fetch from code allocated there could
+// be taken for a call into the host.
+uint32_t *DynamicLoader::allocateCode(size_t Size) {
+  assert(Size <= AllocGranularity && "Too much code.");
+
+  // Allocate new chunk if needed.
+  if (CodeChunkUsed + Size > AllocGranularity) {
+    CodeChunk = reinterpret_cast<uint32_t *>(
+        VirtualAllocFromApp(nullptr, AllocGranularity, MEM_RESERVE | MEM_COMMIT,
+                            PAGE_READWRITE));
+    if (!CodeChunk) {
+      Log.error("couldn't allocate memory for generated code");
+      return nullptr;
+    }
+    Emu.mapMemory(reinterpret_cast<uint64_t>(CodeChunk), AllocGranularity,
+                  UC_PROT_READ | UC_PROT_EXEC);
+    CodeChunkUsed = 0;
+  }
+
+  uint32_t *Code = CodeChunk + CodeChunkUsed / sizeof(uint32_t);
+  CodeChunkUsed += Size;
+  return Code;
+}
+
+uint64_t DynamicLoader::createSvcStub(uint64_t Target) {
+  auto I = SvcStubs.find(Target);
+  if (I != SvcStubs.end())
+    return I->second;
+
+  // If there are too many stubs, the target will be dispatched via
+  // fetch-protection faults instead.
+  uint32_t Idx = SvcTargetCount.load(memory_order_relaxed);
+  if (Idx == MaxSvcStubs)
+    return Target;
+  if (!SvcTargets)
+    SvcTargets = make_unique<uint64_t[]>(MaxSvcStubs);
+
+  uint32_t *Stub = allocateCode(SvcStubSize);
+  if (!Stub)
+    return Target;
+
+  // Generate the stub. The immediate operand of `svc` is 24 bits wide.
+  Stub[0] = SvcInsn | Idx;
+  Stub[1] = BxLrInsn;
+
+  // Publish the target (`getSvcTarget` can run concurrently in other threads).
+  uint64_t StubAddr = reinterpret_cast<uint64_t>(Stub);
+  SvcTargets[Idx] = Target;
+  SvcTargetCount.store(Idx + 1, memory_order_release);
+  SvcStubs[Target] = StubAddr;
+  return StubAddr;
+}
+
+// Creates emulated `dyld_stub_binder`. It consists of a single `svc` which is
+// handled by `SysTranslator::handleStubBinder`.
+uint64_t DynamicLoader::createStubBinder() {
+  if (!StubBinder)
+    if (uint32_t *Code = allocateCode(sizeof(uint32_t))) {
+      Code[0] = StubBinderInsn;
+      StubBinder = reinterpret_cast<uint64_t>(Code);
+    }
+  return StubBinder;
+}
+
+// Inspired by `ImageLoaderMachOCompressed::doBindFastLazySymbol`.
+uint64_t DynamicLoader::bindLazySymbol(uint64_t Cache, uint32_t Offset) {
+  using namespace llvm::MachO;
+
+  auto Lock = lock();
+
+  LibraryInfo LI(lookup(Cache));
+  auto *Dylib = dynamic_cast<LoadedDylib *>(LI.Lib);
+  DyldBind Bind;
+  if (!Dylib || !Dylib->getMachO().findLazyBind(Offset, Bind)) {
+    Log.error() << "invalid lazy binding info for " << dumpAddr(Cache)
+                << Log.end();
+    return 0;
+  }
+  Dylib->checkInRange(Bind.Addr);
+
+  // Find symbol's library.
+  LoadedLibrary *Lib = nullptr;
+  if (Bind.Ordinal == BIND_SPECIAL_DYLIB_SELF)
+    Lib = Dylib;
+  else if (Bind.Ordinal > 0 &&
+           static_cast<size_t>(Bind.Ordinal) <= Dylib->Dependencies.size())
+    Lib = load(Dylib->Dependencies[Bind.Ordinal - 1].Name);
+  if (!Lib) {
+    Log.error() << "library of lazy symbol " << Bind.Name
+                << " couldn't be loaded" << Log.end();
+    return 0;
+  }
+
+  // Find symbol's address.
+  uint64_t SymAddr = Lib->findSymbol(*this, Bind.Name);
+  if (!SymAddr) {
+    Log.error() << "lazy symbol " << Bind.Name << " couldn't be resolved"
+                << Log.end();
+    return 0;
+  }
+
+  // Patch the lazy pointer, so that next calls don't go through the binder.
+  uint64_t Addr = bindSymbol(SymAddr, getBindKind(Bind.Name), Lib);
+  *reinterpret_cast<uint32_t *>(Bind.Addr) = Addr;
+  if constexpr (PrintEmuInfo)
+    Log.info() << "lazily bound " << Bind.Name << " to " << dumpAddr(Addr)
+               << Log.end();
+  return Addr;
+}
+
+bool DynamicLoader::createMsgEpoch() {
+  if (MsgEpoch)
+    return true;
+
+  void *Page = _aligned_malloc(PageSize, PageSize);
+  if (!Page) {
+    Log.error("couldn't allocate memory for method cache");
+    return false;
+  }
+  MsgEpoch = new (Page) atomic<uint32_t>(1);
+  Emu.mapMemory(reinterpret_cast<uint64_t>(Page), PageSize,
+                UC_PROT_READ | UC_PROT_WRITE);
+  return true;
+}
+
+uint64_t DynamicLoader::allocateMsgCache() {
+  auto Lock = lock();
+  if (!UseGuestMsgSend || !createMsgEpoch())
+    return 0;
+  if (!FreeMsgCaches.empty()) {
+    uint64_t Cache = FreeMsgCaches.back();
+    FreeMsgCaches.pop_back();
+    return Cache;
+  }
+
+  // Zeroed memory is an empty cache (no class is at address 0).
+  auto Cache = reinterpret_cast<uint64_t>(VirtualAllocFromApp(
+      nullptr, sizeof(MsgCacheTy), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+  if (!Cache) {
+    Log.error("couldn't allocate memory for method cache");
+    return 0;
+  }
+  Emu.mapMemory(Cache, sizeof(MsgCacheTy), UC_PROT_READ | UC_PROT_WRITE);
+  return Cache;
+}
+
+void DynamicLoader::releaseMsgCache(uint64_t Cache) {
+  if (!Cache)
+    return;
+  auto Lock = lock();
+  FreeMsgCaches.push_back(Cache);
+}
+
+// Encodes ARM instruction `Insn` (which must be `ldr Rt, [pc, #0]`) at `At` so
+// that it loads literal `Lit`.
+static uint32_t ldrLiteral(uint32_t Insn, const uint32_t *At,
+                           const uint32_t *Lit) {
+  // PC reads as the address of the current instruction plus 8.
+  ptrdiff_t Offset = (Lit - At - 2) * sizeof(uint32_t);
+  assert(Offset >= 0 && Offset < 4096);
+  return Insn | Offset;
+}
+
+// Generates ARM code equivalent to `objc_msgSend` that first probes the calling
+// thread's method cache (see `allocateMsgCache`). On a hit, it jumps directly
+// to the cached IMP. On a miss, it calls `Lookup` (i.e., `objc_msgLookup`),
+// caches its result and jumps there. Messages to nil are handled by `Fallback`
+// (i.e., the original messenger).
+uint64_t DynamicLoader::createMsgSend(uint64_t Fallback, uint64_t Lookup) {
+  auto I = MsgSends.find(Fallback);
+  if (I != MsgSends.end())
+    return I->second;
+  if (!createMsgEpoch())
+    return Fallback;
+
+  // Note that registers `r0`-`r3` must be preserved, so that they can be passed
+  // to the IMP. Register `r12` is the only one we can clobber without saving.
+  // Entries are indexed by `((Class ^ Sel) >> 2) % MsgCacheSize`.
+  static_assert(MsgCacheSize == 4096 && sizeof(MsgCacheEntry) == 16,
+                "Hash computation below must be updated.");
+  static constexpr uint32_t Code[] = {
+      // Probe the cache.
+      0xE3500000, // 0: cmp r0, #0
+      0x0A000014, // 1: beq 23 (miss)
+      0xE92D0070, // 2: push {r4, r5, r6}
+      0xEE1D5F70, // 3: mrc p15, 0, r5, c13, c0, 3 (entries)
+      0xE3550000, // 4: cmp r5, #0 (no cache in this thread)
+      0x08BD0070, // 5: popeq {r4, r5, r6}
+      0x0A00000F, // 6: beq 23 (miss)
+      0xE5904000, // 7: ldr r4, [r0] (isa)
+      0xE024C001, // 8: eor r12, r4, r1
+      0xE1A0C12C, // 9: lsr r12, r12, #2
+      0xE1A0CA0C, // 10: lsl r12, r12, #20
+      0xE085C82C, // 11: add r12, r5, r12, lsr #16 (entry)
+      0xE59C6000, // 12: ldr r6, [r12] (class)
+      0xE1560004, // 13: cmp r6, r4
+      0x059C6004, // 14: ldreq r6, [r12, #4] (sel)
+      0x01560001, // 15: cmpeq r6, r1
+      0x059C600C, // 16: ldreq r6, [r12, #12] (entry's epoch)
+      0x059F4000, // 17: ldreq r4, [pc, #?] (epoch)
+      0x05944000, // 18: ldreq r4, [r4]
+      0x01560004, // 19: cmpeq r6, r4
+      0x059CC008, // 20: ldreq r12, [r12, #8] (IMP)
+      0xE8BD0070, // 21: pop {r4, r5, r6}
+      0x012FFF1C, // 22: bxeq r12
+      // Handle miss.
+      0xE3500000, // 23: cmp r0, #0
+      0x059FF000, // 24: ldreq pc, [pc, #?] (fallback)
+      0xE92D401F, // 25: push {r0, r1, r2, r3, r4, lr}
+      0xE59FC000, // 26: ldr r12, [pc, #?] (lookup)
+      0xE12FFF3C, // 27: blx r12
+      0xE1A0C000, // 28: mov r12, r0
+      0xE8BD401F, // 29: pop {r0, r1, r2, r3, r4, lr}
+      0xE92D0070, // 30: push {r4, r5, r6}
+      0xEE1D5F70, // 31: mrc p15, 0, r5, c13, c0, 3 (entries)
+      0xE3550000, // 32: cmp r5, #0 (no cache in this thread)
+      0x08BD0070, // 33: popeq {r4, r5, r6}
+      0x012FFF1C, // 34: bxeq r12
+      0xE5904000, // 35: ldr r4, [r0] (isa)
+      0xE0246001, // 36: eor r6, r4, r1
+      0xE1A06126, // 37: lsr r6, r6, #2
+      0xE1A06A06, // 38: lsl r6, r6, #20
+      0xE0856826, // 39: add r6, r5, r6, lsr #16 (entry)
+      0xE59F5000, // 40: ldr r5, [pc, #?] (epoch)
+      0xE5955000, // 41: ldr r5, [r5]
+      0xE5861004, // 42: str r1, [r6, #4]
+      0xE586C008, // 43: str r12, [r6, #8]
+      0xE586500C, // 44: str r5, [r6, #12]
+      0xE5864000, // 45: str r4, [r6]
+      0xE8BD0070, // 46: pop {r4, r5, r6}
+      0xE12FFF1C, // 47: bx r12
+  };
+  enum { EpochLit = size(Code), FallbackLit, LookupLit, CodeSize };
+
+  uint32_t *MsgSend = allocateCode(CodeSize * sizeof(uint32_t));
+  if (!MsgSend)
+    return Fallback;
+  copy(begin(Code), end(Code), MsgSend);
+  uint32_t *Lits = MsgSend + size(Code);
+  Lits[0] = reinterpret_cast<uintptr_t>(MsgEpoch);
+  Lits[1] = Fallback;
+  Lits[2] = Lookup;
+  MsgSend[17] = ldrLiteral(Code[17], MsgSend + 17, MsgSend + EpochLit);
+  MsgSend[24] = ldrLiteral(Code[24], MsgSend + 24, MsgSend + FallbackLit);
+  MsgSend[26] = ldrLiteral(Code[26], MsgSend + 26, MsgSend + LookupLit);
+  MsgSend[40] = ldrLiteral(Code[40], MsgSend + 40, MsgSend + EpochLit);
+
+  uint64_t Addr = reinterpret_cast<uint64_t>(MsgSend);
+  MsgSends[Fallback] = Addr;
+  return Addr;
+}
+
+// Generates ARM code that calls `Target` and then flushes the method caches.
+// Flushing before the call wouldn't do, another thread could cache the old IMP
+// before `Target` changes it.
+uint64_t DynamicLoader::createFlushThunk(uint64_t Target) {
+  auto I = FlushThunks.find(Target);
+  if (I != FlushThunks.end())
+    return I->second;
+  if (!createMsgEpoch())
+    return Target;
+
+  // Mutators take at most four arguments, so none are passed on the stack.
+  static constexpr uint32_t Code[] = {
+      0xE92D4010, // 0: push {r4, lr}
+      0xE59FC000, // 1: ldr r12, [pc, #?] (target)
+      0xE12FFF3C, // 2: blx r12
+      0xE59FC000, // 3: ldr r12, [pc, #?] (epoch)
+      0xE59C2000, // 4: ldr r2, [r12]
+      0xE2822001, // 5: add r2, r2, #1
+      0xE58C2000, // 6: str r2, [r12]
+      0xE8BD8010, // 7: pop {r4, pc}
+  };
+  enum { TargetLit = size(Code), EpochLit, CodeSize };
+
+  uint32_t *Thunk = allocateCode(CodeSize * sizeof(uint32_t));
+  if (!Thunk)
+    return Target;
+  copy(begin(Code), end(Code), Thunk);
+  Thunk[TargetLit] = Target;
+  Thunk[EpochLit] = reinterpret_cast<uintptr_t>(MsgEpoch);
+  Thunk[1] = ldrLiteral(Code[1], Thunk + 1, Thunk + TargetLit);
+  Thunk[3] = ldrLiteral(Code[3], Thunk + 3, Thunk + EpochLit);
+
+  uint64_t Addr = reinterpret_cast<uint64_t>(Thunk);
+  FlushThunks[Target] = Addr;
+  return Addr;
+}
+
+LaunchClosure::BindKind DynamicLoader::getBindKind(const string &SymName) {
+  using BindKind = LaunchClosure::BindKind;
+
+  if (SymName == "_objc_msgSend")
+    return BindKind::MsgSend;
+  if (SymName == "dyld_stub_binder")
+    return BindKind::StubBinder;
+  if (!SymName.empty() && SymName[0] == '_')
+    for (const char *Mutator : MsgCacheMutators)
+      if (!SymName.compare(1, string::npos, Mutator))
+        return BindKind::MsgCacheMutator;
+  return BindKind::Normal;
+}
+
 LibraryInfo DynamicLoader::lookup(uint64_t Addr) {
-  for (auto &Pair : LLs) {
-    LoadedLibrary *LL = Pair.second.get();
-    if (LL->isInRange(Addr))
-      return {&Pair.first, LL};
+  auto Lock = lock();
+  // Find the last library starting at or before `Addr`. Libraries don't
+  // overlap, so it's the only one that can contain `Addr`.
+  auto I = upper_bound(
+      Ranges.begin(), Ranges.end(), Addr,
+      [](uint64_t Addr, const auto &Range) { return Addr < Range.first; });
+  if (I != Ranges.begin()) {
+    const LibraryInfo &LI = prev(I)->second;
+    if (LI.Lib->isInRange(Addr))
+      return LI;
   }
   return {nullptr, nullptr};
 }
 
+bool DynamicLoader::symbolize(uint64_t Addr, SymbolInfo &Info) {
+  auto Lock = lock();
+  LibraryInfo LI(lookup(Addr));
+  auto *Dylib = dynamic_cast<LoadedDylib *>(LI.Lib);
+  if (!Dylib)
+    return false;
+
+  const SymbolIndex::Entry *E =
+      Dylib->getSymbolIndex().findPreceding(Addr - Dylib->StartAddress);
+  if (!E)
+    return false;
+  Info.LI = LI;
+  Info.Name = E->Name;
+  Info.Offset = Addr - Dylib->StartAddress - E->RVA;
+  return true;
+}
+
 LogStream::Handler DynamicLoader::dumpAddr(uint64_t Addr) {
   return [this, Addr](LogStream &S) {
     if (Addr == KernelAddr)
@@ -385,11 +1523,21 @@ LogStream::Handler DynamicLoader::dumpAddr(uint64_t Addr,
       S << "0x" << to_hex_string(Addr);
       return;
     }
-    if (LI.Lib->hasMachO())
+    if (LI.Lib->hasMachO()) {
+      // `findMethod` can build the library's `MethodIndex`.
+      auto Lock = lock();
       if (ObjCMethod M = LI.Lib->getMachO().findMethod(Addr)) {
         S << dumpAddr(Addr, LI, M);
         return;
       }
+    }
+    SymbolInfo Info;
+    if (symbolize(Addr, Info)) {
+      S << Info.Name;
+      if (Info.Offset)
+        S << "+0x" << to_hex_string(Info.Offset);
+      S << "!";
+    }
     S << dumpAddrImpl(Addr, LI);
   };
 }
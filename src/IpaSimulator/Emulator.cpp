@@ -3,10 +3,31 @@
 #include "ipasim/Emulator.hpp"
 
 #include "ipasim/IpaSimulator.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
 
+#include <atomic>
+#include <mutex>
 #include <unicorn/unicorn.h>
+#include <vector>
 
 using namespace ipasim;
+using namespace std;
+
+namespace {
+
+// Mapping made by `Emulator::mapMemory`
+struct Mapping {
+  uint64_t Addr, End;
+  uc_prot Perms;
+  bool Override; // Whether to change permissions of already mapped parts
+};
+
+// Mappings shared by all engines
+mutex MappingsMutex;
+vector<Mapping> Mappings;
+atomic<size_t> MappingCount(0); // Size of `Mappings` (readable without lock)
+
+} // namespace
 
 Emulator::~Emulator() {
   if (UC)
@@ -22,14 +43,168 @@ void Emulator::writeReg(uc_arm_reg RegId, uint32_t Value) {
   callUC(uc_reg_write(UC, RegId, &Value));
 }
 
-// TODO: What if the mappings overlap?
+void Emulator::readRegs(const uc_arm_reg *RegIds, uint32_t *Values,
+                        size_t Count) {
+  assert(Count <= MaxBatch);
+  int Ids[MaxBatch];
+  void *Ptrs[MaxBatch];
+  for (size_t I = 0; I != Count; ++I) {
+    Ids[I] = RegIds[I];
+    Ptrs[I] = &Values[I];
+  }
+  callUC(uc_reg_read_batch(UC, Ids, Ptrs, Count));
+}
+void Emulator::writeRegs(const uc_arm_reg *RegIds, const uint32_t *Values,
+                         size_t Count) {
+  assert(Count <= MaxBatch);
+  int Ids[MaxBatch];
+  void *Ptrs[MaxBatch];
+  for (size_t I = 0; I != Count; ++I) {
+    Ids[I] = RegIds[I];
+    Ptrs[I] = const_cast<uint32_t *>(&Values[I]);
+  }
+  callUC(uc_reg_write_batch(UC, Ids, Ptrs, Count));
+}
+
 void Emulator::mapMemory(uint64_t Addr, uint64_t Size, uc_prot Perms) {
-  if (uc_mem_map_ptr(UC, Addr, Size, Perms, reinterpret_cast<void *>(Addr)))
-    Log.error() << "couldn't map memory at 0x" << to_hex_string(Addr)
-                << " of size 0x" << to_hex_string(Size) << Log.end();
+  lock_guard<mutex> Lock(MappingsMutex);
+  Mappings.push_back(Mapping{Addr, Addr + Size, Perms,
+                             /* Override */ true});
+  MappingCount = Mappings.size();
+}
+
+bool Emulator::mapHostRegion(uint64_t Addr, uc_prot Perms) {
+  MEMORY_BASIC_INFORMATION Info;
+  if (!VirtualQuery(reinterpret_cast<void *>(Addr), &Info, sizeof(Info)) ||
+      Info.State != MEM_COMMIT)
+    return false;
+
+  // The allocation can contain already mapped memory with other permissions
+  // (e.g., segments of Mach-O images), so don't override them.
+  auto Start = reinterpret_cast<uint64_t>(Info.BaseAddress);
+  {
+    lock_guard<mutex> Lock(MappingsMutex);
+    Mappings.push_back(Mapping{Start, Start + Info.RegionSize, Perms,
+                               /* Override */ false});
+    MappingCount = Mappings.size();
+  }
+  sync();
+  if constexpr (PrintEmuInfo)
+    Log.info() << "mapped host region at 0x" << to_hex_string(Start)
+               << " of size 0x" << to_hex_string(Info.RegionSize) << " ("
+               << Regions.size() << " regions)" << Log.end();
+  return true;
+}
+
+bool Emulator::isExecutable(uint64_t Addr) {
+  auto I = Regions.upper_bound(Addr);
+  if (I == Regions.begin())
+    return false;
+  const Region &R = prev(I)->second;
+  return Addr < R.End && (R.Perms & UC_PROT_EXEC);
+}
+
+bool Emulator::sync() {
+  if (Synced == MappingCount)
+    return false;
+
+  lock_guard<mutex> Lock(MappingsMutex);
+  for (size_t End = Mappings.size(); Synced != End; ++Synced) {
+    Mapping &M = Mappings[Synced];
+    mapRange(M.Addr, M.End, M.Perms, M.Override);
+  }
+  return true;
+}
+
+// Maps gaps between existing regions in range [`Addr`, `End`). If `Override`
+// is `true`, also changes permissions of the existing regions (host memory can
+// be reused, e.g., a freed heap block can become generated code).
+void Emulator::mapRange(uint64_t Addr, uint64_t End, uc_prot Perms,
+                        bool Override) {
+  while (Addr < End) {
+    auto I = Regions.upper_bound(Addr);
+    if (I != Regions.begin() && prev(I)->second.End > Addr) {
+      auto R = prev(I);
+      uint64_t OverlapEnd = min(End, R->second.End);
+      if (Override && R->second.Perms != Perms)
+        protectRegion(R, Addr, OverlapEnd, Perms);
+      Addr = OverlapEnd;
+      continue;
+    }
+
+    uint64_t GapEnd = I != Regions.end() ? min(End, I->first) : End;
+    mapRegion(Addr, GapEnd, Perms);
+    Addr = GapEnd;
+  }
+}
+
+// Maps unmapped range [`Start`, `End`). Unicorn's lookup of regions gets slow
+// when there are many of them, so adjacent regions with the same permissions
+// are merged. That means remapping them, so only data are merged (unmapping
+// code would throw away its translated blocks, possibly while it's executing).
+void Emulator::mapRegion(uint64_t Start, uint64_t End, uc_prot Perms) {
+  auto Next = Regions.lower_bound(Start);
+  auto Prev = Next != Regions.begin() ? prev(Next) : Regions.end();
+  bool MergePrev = !(Perms & UC_PROT_EXEC) && Prev != Regions.end() &&
+                   Prev->second.End == Start && Prev->second.Perms == Perms;
+  bool MergeNext = !(Perms & UC_PROT_EXEC) && Next != Regions.end() &&
+                   Next->first == End && Next->second.Perms == Perms;
+
+  uint64_t NewStart = MergePrev ? Prev->first : Start;
+  uint64_t NewEnd = MergeNext ? Next->second.End : End;
+  if (MergePrev)
+    callUC(uc_mem_unmap(UC, Prev->first, Start - Prev->first));
+  if (MergeNext)
+    callUC(uc_mem_unmap(UC, End, NewEnd - End));
+  if (mapPtr(NewStart, NewEnd, Perms)) {
+    if (MergeNext)
+      Regions.erase(Next);
+    if (MergePrev)
+      Prev->second.End = NewEnd;
+    else
+      Regions[NewStart] = Region{NewEnd, Perms};
+    return;
+  }
+
+  // Restore the original regions.
+  if (MergePrev)
+    mapPtr(Prev->first, Start, Perms);
+  if (MergeNext)
+    mapPtr(End, NewEnd, Perms);
+  if ((MergePrev || MergeNext) && mapPtr(Start, End, Perms))
+    Regions[Start] = Region{End, Perms};
+}
+
+// Changes permissions of range [`Start`, `End`) inside region `R`.
+void Emulator::protectRegion(map<uint64_t, Region>::iterator R, uint64_t Start,
+                             uint64_t End, uc_prot Perms) {
+  callUC(uc_mem_protect(UC, Start, End - Start, Perms));
+
+  // Split the region.
+  Region Old = R->second;
+  if (R->first < Start)
+    R->second.End = Start;
+  else
+    Regions.erase(R);
+  Regions[Start] = Region{End, Perms};
+  if (End < Old.End)
+    Regions[End] = Old;
 }
 
-void Emulator::start(uint64_t Addr) { callUC(uc_emu_start(UC, Addr, 0, 0, 0)); }
+bool Emulator::mapPtr(uint64_t Start, uint64_t End, uc_prot Perms) {
+  if (uc_mem_map_ptr(UC, Start, End - Start, Perms,
+                     reinterpret_cast<void *>(Start))) {
+    Log.error() << "couldn't map memory at 0x" << to_hex_string(Start)
+                << " of size 0x" << to_hex_string(End - Start) << Log.end();
+    return false;
+  }
+  return true;
+}
+
+void Emulator::start(uint64_t Addr, uint64_t Until) {
+  sync();
+  callUC(uc_emu_start(UC, Addr, Until, 0, 0));
+}
 
 void Emulator::stop() { callUC(uc_emu_stop(UC)); }
 
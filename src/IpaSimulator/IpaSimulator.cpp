@@ -14,15 +14,22 @@ using namespace winrt;
 using namespace Windows::ApplicationModel::Activation;
 
 // TODO: This Emu-Dyld circular reference is not very cool.
-IpaSimulator::IpaSimulator() : Emu(Dyld), Dyld(Emu), Sys(Dyld, Emu) {}
+IpaSimulator::IpaSimulator()
+    : Emu(Dyld), Dyld(Emu), Types(Dyld), Sys(Dyld, Emu, Types) {}
 
 void ipasim::start(const hstring &Path,
                    const LaunchActivatedEventArgs &LaunchArgs) {
   // Load the binary.
   IpaSim.MainBinary = to_string(Path);
+  IpaSim.Dyld.openClosure(IpaSim.MainBinary);
   LoadedLibrary *App = IpaSim.Dyld.load(IpaSim.MainBinary);
   if (!App)
     return;
+  IpaSim.Dyld.saveClosure();
+
+  // Prepare execution contexts for threads started by the app (e.g., workers
+  // of `libdispatch`) while the main thread executes it.
+  IpaSim.Sys.prewarmContexts();
 
   // Execute it.
   IpaSim.Sys.execute(App);
@@ -63,7 +70,33 @@ IPASIM_API void *ipaSim_callBack3r(void *FP, void *Arg0, void *Arg1,
                                    void *Arg2) {
   return IpaSim.Sys.callBackR(FP, Arg0, Arg1, Arg2);
 }
+// Used by `objc_sizeof_type` and related functions in `src/objc/stubs.mm`.
+IPASIM_API bool ipaSim_getTypeLayout(const char *Type, size_t *Size,
+                                     size_t *Align) {
+  shared_ptr<const TypeLayout> L = IpaSim.Types.getType(Type);
+  if (!L)
+    return false;
+
+  // The runtime is native, so it needs the host's layout.
+  if (!L->Size || !L->FFIType) {
+    *Size = 0;
+    *Align = 1;
+  } else {
+    *Size = L->FFIType->size;
+    *Align = L->FFIType->alignment;
+  }
+  return true;
+}
 IPASIM_API void ipaSim_register(void *Hdr) { IpaSim.Dyld.registerMachO(Hdr); }
+IPASIM_API void ipaSim_setSvcDispatch(bool Enable) {
+  IpaSim.Dyld.setSvcDispatch(Enable);
+}
+IPASIM_API void ipaSim_setGuestMessenger(bool Enable) {
+  IpaSim.Dyld.setGuestMessenger(Enable);
+}
+IPASIM_API void ipaSim_flushMsgCache() { IpaSim.Dyld.flushMsgCache(); }
+// Called by `realizeClass` in our port of the Objective-C runtime.
+IPASIM_API void ipaSim_classRealized() { ObjCMethodIndex::classRealized(); }
 IPASIM_API void
 _dyld_objc_notify_register(_dyld_objc_notify_mapped Mapped,
                            _dyld_objc_notify_init Init,
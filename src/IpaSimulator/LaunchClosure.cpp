@@ -0,0 +1,213 @@
+// LaunchClosure.cpp: Implementation of class `LaunchClosure`.
+
+#include "ipasim/LaunchClosure.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <type_traits>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+template <typename T> bool readVal(istream &S, T &Val) {
+  static_assert(is_trivially_copyable_v<T>);
+  return static_cast<bool>(S.read(reinterpret_cast<char *>(&Val), sizeof(T)));
+}
+template <typename T> bool readVec(istream &S, vector<T> &Vec) {
+  uint32_t Size;
+  if (!readVal(S, Size))
+    return false;
+  Vec.resize(Size);
+  return Size == 0 || S.read(reinterpret_cast<char *>(Vec.data()),
+                             Size * sizeof(T));
+}
+bool readStr(istream &S, string &Str) {
+  uint32_t Size;
+  if (!readVal(S, Size))
+    return false;
+  Str.resize(Size);
+  return Size == 0 || S.read(Str.data(), Size);
+}
+
+template <typename T> void writeVal(ostream &S, const T &Val) {
+  static_assert(is_trivially_copyable_v<T>);
+  S.write(reinterpret_cast<const char *>(&Val), sizeof(T));
+}
+template <typename T> void writeVec(ostream &S, const vector<T> &Vec) {
+  writeVal(S, static_cast<uint32_t>(Vec.size()));
+  S.write(reinterpret_cast<const char *>(Vec.data()), Vec.size() * sizeof(T));
+}
+void writeStr(ostream &S, const string &Str) {
+  writeVal(S, static_cast<uint32_t>(Str.size()));
+  S.write(Str.data(), Str.size());
+}
+
+} // namespace
+
+bool LaunchClosure::read(const string &File) {
+  ifstream S(File, ios::binary);
+  if (!S)
+    return false;
+
+  uint32_t FileMagic, FileVersion, Count;
+  if (!readVal(S, FileMagic) || FileMagic != Magic ||
+      !readVal(S, FileVersion) || FileVersion != Version ||
+      !readVal(S, Count))
+    return false;
+
+  deque<Image> NewImages(Count);
+  for (Image &I : NewImages) {
+    I.State = HashState::Unknown;
+    if (!readStr(S, I.Path) || !readVal(S, I.Hash) ||
+        !readVal(S, I.HasRecord))
+      return false;
+    if (I.HasRecord &&
+        (!readVal(S, I.R.LowAddr) || !readVal(S, I.R.HighAddr) ||
+         !readVec(S, I.R.Deps) || !readVec(S, I.R.Rebases) ||
+         !readVec(S, I.R.Binds)))
+      return false;
+  }
+
+  // Check that ids and written pointers are in range, so that we don't have to
+  // do that later.
+  for (Image &I : NewImages) {
+    auto IsOutOfRange = [Count](uint32_t Id) { return Id >= Count; };
+    if (any_of(I.R.Deps.begin(), I.R.Deps.end(), IsOutOfRange) ||
+        any_of(I.R.Binds.begin(), I.R.Binds.end(),
+               [&](const Bind &B) { return IsOutOfRange(B.Target); }))
+      return false;
+    if (!I.HasRecord)
+      continue;
+    if (I.R.HighAddr <= I.R.LowAddr)
+      return false;
+    uint64_t Size = I.R.HighAddr - I.R.LowAddr;
+    if (any_of(I.R.Rebases.begin(), I.R.Rebases.end(),
+               [Size](uint32_t Offset) {
+                 return Offset + sizeof(uint32_t) > Size;
+               }) ||
+        any_of(I.R.Binds.begin(), I.R.Binds.end(), [&](const Bind &B) {
+          return B.Offset < I.R.LowAddr ||
+                 B.Offset + sizeof(uint32_t) > I.R.HighAddr;
+        }))
+      return false;
+  }
+
+  Images = move(NewImages);
+  Ids.clear();
+  for (uint32_t Id = 0; Id != Count; ++Id)
+    Ids[Images[Id].Path] = Id;
+  Dirty = false;
+  return true;
+}
+
+bool LaunchClosure::write(const string &File) {
+  ofstream S(File, ios::binary | ios::trunc);
+  if (!S)
+    return false;
+
+  writeVal(S, Magic);
+  writeVal(S, Version);
+  writeVal(S, static_cast<uint32_t>(Images.size()));
+  for (Image &I : Images) {
+    writeStr(S, I.Path);
+    writeVal(S, I.Hash);
+    writeVal(S, I.HasRecord);
+    if (I.HasRecord) {
+      writeVal(S, I.R.LowAddr);
+      writeVal(S, I.R.HighAddr);
+      writeVec(S, I.R.Deps);
+      writeVec(S, I.R.Rebases);
+      writeVec(S, I.R.Binds);
+    }
+  }
+
+  if (!S)
+    return false;
+  Dirty = false;
+  return true;
+}
+
+const LaunchClosure::Record *LaunchClosure::find(const string &Path) {
+  auto It = Ids.find(Path);
+  if (It == Ids.end())
+    return nullptr;
+  Image &I = Images[It->second];
+
+  // Validating can drop the record, so check it afterwards.
+  validate(It->second);
+  for (uint32_t Dep : I.R.Deps)
+    validate(Dep);
+  return I.HasRecord ? &I.R : nullptr;
+}
+
+void LaunchClosure::add(const string &Path, Record &&R) {
+  Image &I = Images[getId(Path)];
+  I.R = move(R);
+  I.HasRecord = true;
+  Dirty = true;
+}
+
+uint32_t LaunchClosure::getId(const string &Path) {
+  auto [It, New] = Ids.try_emplace(Path, Images.size());
+  if (New) {
+    Images.push_back(Image{Path, hashFile(Path), HashState::Valid,
+                           /* HasRecord */ false, Record{}});
+    Dirty = true;
+  } else
+    validate(It->second);
+  return It->second;
+}
+
+// Checks that binary `Id` hasn't changed. If it has, drops all records that
+// depend on it.
+bool LaunchClosure::validate(uint32_t Id) {
+  Image &I = Images[Id];
+  if (I.State == HashState::Unknown) {
+    uint64_t Hash = hashFile(I.Path);
+    if (Hash && Hash == I.Hash)
+      I.State = HashState::Valid;
+    else {
+      for (Image &Other : Images)
+        if (Other.HasRecord && (&Other == &I ||
+                                std::find(Other.R.Deps.begin(),
+                                          Other.R.Deps.end(),
+                                          Id) != Other.R.Deps.end())) {
+          Other.HasRecord = false;
+          Other.R = Record{};
+        }
+
+      // From now on, new records can depend on the current version.
+      I.Hash = Hash;
+      I.State = Hash ? HashState::Valid : HashState::Invalid;
+      Dirty = true;
+    }
+  }
+  return I.State == HashState::Valid;
+}
+
+// Computes FNV-1a-style hash of file's content (processed in 64-bit words).
+uint64_t LaunchClosure::hashFile(const string &Path) {
+  ifstream S(Path, ios::binary);
+  if (!S)
+    return 0;
+
+  uint64_t Hash = 0xCBF29CE484222325;
+  vector<char> Buffer(1 << 20);
+  while (S) {
+    S.read(Buffer.data(), Buffer.size());
+    size_t Size = S.gcount();
+    size_t I = 0;
+    for (; I + sizeof(uint64_t) <= Size; I += sizeof(uint64_t)) {
+      uint64_t Word;
+      memcpy(&Word, Buffer.data() + I, sizeof(Word));
+      Hash = (Hash ^ Word) * 0x100000001B3;
+    }
+    for (; I != Size; ++I)
+      Hash = (Hash ^ static_cast<uint8_t>(Buffer[I])) * 0x100000001B3;
+  }
+  return Hash;
+}
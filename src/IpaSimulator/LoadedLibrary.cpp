@@ -6,73 +6,98 @@
 #include "ipasim/DynamicLoader.hpp"
 #include "ipasim/IpaSimulator.hpp"
 
+#include <llvm/BinaryFormat/MachO.h>
+
 using namespace ipasim;
 using namespace std;
 
-DylibSymbolIterator DylibSymbolIterator::begin() {
-  return DylibSymbolIterator(RVA, Symbols.begin()).next();
+bool LoadedLibrary::isInRange(uint64_t Addr) {
+  return LowAddress <= Addr && Addr < LowAddress + Size;
 }
 
-DylibSymbolIterator &DylibSymbolIterator::next() {
-  while (Symbols != Symbols.end() && Symbols->value() != RVA)
-    ++Symbols;
-  return *this;
+bool LoadedLibrary::checkInRange(uint64_t Addr) {
+  if (isInRange(Addr))
+    return true;
+  Log.error() << "address " << Addr << " out of range" << Log.end();
+  return false;
 }
 
-DylibSymbolIterator &DylibSymbolIterator::operator++() {
-  ++Symbols;
-  return next();
+uint64_t LoadedLibrary::findPrefixedSymbol(DynamicLoader &DL,
+                                           const string &Name) {
+  // If this library is DLL, it doesn't have underscore prefixes, so we need to
+  // remove it.
+  if (!hasUnderscorePrefix() && Name[0] == '_')
+    return static_cast<LoadedDll *>(this)->findSymbol(Name.c_str() + 1);
+  return findSymbol(DL, Name);
 }
 
-bool DylibSymbolIterator::operator!=(const DylibSymbolIterator &Other) {
-  return Symbols != Other.Symbols;
+LoadedDylib::LoadedDylib(LIEF::MachO::Binary &Bin, StringPool &Strings)
+    : Entrypoint(Bin.has_entrypoint() ? Bin.entrypoint() : 0),
+      ImageBase(Bin.imagebase()) {
+  using namespace LIEF::MachO;
+  using namespace llvm::MachO;
+
+  for (DylibCommand &Lib : Bin.libraries())
+    Dependencies.push_back(
+        {Strings.intern(Lib.name()),
+         Lib.command() == LOAD_COMMAND_TYPES::LC_REEXPORT_DYLIB});
+
+  // Index all symbols defined in some section (including non-exported ones,
+  // so that nearest symbols found by `DynamicLoader::symbolize` are precise).
+  for (LIEF::MachO::Symbol &Sym : Bin.symbols())
+    if (!(Sym.type() & N_STAB) && (Sym.type() & N_TYPE) == N_SECT)
+      SymIndex.add(Sym.value(), Strings.intern(Sym.name()));
+  SymIndex.finish();
 }
 
-LIEF::MachO::Symbol &DylibSymbolIterator::operator*() { return *Symbols; }
-
-bool LoadedLibrary::isInRange(uint64_t Addr) {
-  return StartAddress <= Addr && Addr < StartAddress + Size;
+uint64_t LoadedDylib::findSymbol(DynamicLoader &DL, const string &Name) {
+  // Note that the entry is inserted before resolving, so that cycles of
+  // re-exports end with a negative result. Also note that references (unlike
+  // iterators) stay valid even if the recursion rehashes `Symbols`.
+  auto [It, New] = Symbols.try_emplace(Name, 0);
+  uint64_t &Addr = It->second;
+  if (New)
+    Addr = resolveSymbol(DL, Name);
+  return Addr;
 }
 
-void LoadedLibrary::checkInRange(uint64_t Addr) {
-  if (!isInRange(Addr))
-    Log.error() << "address " << Addr << " out of range" << Log.end();
-}
+uint64_t LoadedDylib::resolveSymbol(DynamicLoader &DL, const string &Name) {
+  // Look into the export trie.
+  MachOExport Export;
+  if (getMachO().findExport(Name.c_str(), Export)) {
+    if (!Export.Ordinal)
+      return Export.Addr;
+
+    // Follow symbol re-exported from another library.
+    if (Export.Ordinal <= Dependencies.size())
+      if (LoadedLibrary *LL = DL.load(Dependencies[Export.Ordinal - 1].Name))
+        return LL->findPrefixedSymbol(DL, *Export.ImportName
+                                              ? string(Export.ImportName)
+                                              : Name);
+    return 0;
+  }
 
-uint64_t LoadedDylib::findSymbol(DynamicLoader &DL, const string &Name) {
-  using namespace LIEF::MachO;
+  // Try also re-exported libraries.
+  for (const Dependency &Dep : Dependencies) {
+    if (!Dep.ReExport)
+      continue;
 
-  if (!Bin.has_symbol(Name)) {
-    // Try also re-exported libraries.
-    for (DylibCommand &Lib : Bin.libraries()) {
-      if (Lib.command() != LOAD_COMMAND_TYPES::LC_REEXPORT_DYLIB)
-        continue;
-
-      LoadedLibrary *LL = DL.load(Lib.name());
-      if (!LL)
-        continue;
-
-      // If the target library is DLL, it doesn't have underscore prefixes, so
-      // we need to remove it.
-      uint64_t SymAddr;
-      if (!LL->hasUnderscorePrefix() && Name[0] == '_')
-        SymAddr = LL->findSymbol(DL, Name.substr(1));
-      else
-        SymAddr = LL->findSymbol(DL, Name);
-
-      if (SymAddr)
+    if (LoadedLibrary *LL = DL.load(Dep.Name))
+      if (uint64_t SymAddr = LL->findPrefixedSymbol(DL, Name))
         return SymAddr;
-    }
-    return 0;
   }
-  return StartAddress + Bin.get_symbol(Name).value();
+
+  // Fall back to the symbol table (which contains also symbols that are not
+  // exported).
+  if (const SymbolIndex::Entry *E = SymIndex.findByName(Name.c_str()))
+    return StartAddress + E->RVA;
+  return 0;
 }
 
 uint64_t LoadedDll::findSymbol(DynamicLoader &DL, const string &Name) {
-  return (uint64_t)GetProcAddress(Ptr, Name.c_str());
+  return findSymbol(Name.c_str());
 }
 
-DylibSymbolIterator LoadedDylib::lookup(uint64_t Addr) {
-  uint64_t RVA = Addr - StartAddress;
-  return DylibSymbolIterator(RVA, Bin.exported_symbols());
+uint64_t LoadedDll::findSymbol(const char *Name) {
+  return (uint64_t)GetProcAddress(Ptr, Name);
 }
@@ -4,9 +4,12 @@
 
 #include "ipasim/Common.hpp"
 
+#include <llvm/ADT/SmallVector.h>
 #include <llvm/BinaryFormat/MachO.h>
+#include <llvm/Support/LEB128.h>
 
 using namespace ipasim;
+using namespace std;
 
 // Inspired by
 // https://opensource.apple.com/source/cctools/cctools-895/libmacho/getsecbyname.c.auto.html.
@@ -60,6 +63,184 @@ uint64_t MachO::getSection(const char *SegName, const char *SectName,
   return 0;
 }
 
+uint64_t MachO::getSegment(const char *SegName, uint64_t *Size) {
+  using namespace llvm::MachO;
+
+  const segment_command *Text = nullptr, *Found = nullptr;
+  auto *Header = reinterpret_cast<const mach_header *>(Hdr);
+  auto *Cmd = reinterpret_cast<const load_command *>(Header + 1);
+  for (size_t I = 0, IEnd = Header->ncmds; I != IEnd; ++I) {
+    if (Cmd->cmd == LC_SEGMENT) {
+      auto *Seg = reinterpret_cast<const segment_command *>(Cmd);
+      if (!strncmp(Seg->segname, "__TEXT", sizeof(Seg->segname)))
+        Text = Seg;
+      if (!Found && !strncmp(Seg->segname, SegName, sizeof(Seg->segname)))
+        Found = Seg;
+    }
+    Cmd = reinterpret_cast<const load_command *>(bytes(Cmd) + Cmd->cmdsize);
+  }
+  if (!Text || !Found)
+    return 0;
+
+  // Segment `__TEXT` starts with the header.
+  if (Size)
+    *Size = Found->vmsize;
+  return Found->vmaddr + reinterpret_cast<uint64_t>(Hdr) - Text->vmaddr;
+}
+
+// Finds export trie (or lazy binding info if `Lazy` is `true`) referenced by
+// command `LC_DYLD_INFO` in segment `__LINKEDIT`.
+const uint8_t *MachO::getDyldInfo(bool Lazy, uint64_t &Size) {
+  using namespace llvm::MachO;
+
+  auto *Header = reinterpret_cast<const mach_header *>(Hdr);
+  auto *Cmd = reinterpret_cast<const load_command *>(Header + 1);
+  const dyld_info_command *Info = nullptr;
+  const segment_command *Text = nullptr, *LinkEdit = nullptr;
+  for (size_t I = 0, IEnd = Header->ncmds; I != IEnd; ++I) {
+    if (Cmd->cmd == LC_DYLD_INFO || Cmd->cmd == LC_DYLD_INFO_ONLY)
+      Info = reinterpret_cast<const dyld_info_command *>(Cmd);
+    else if (Cmd->cmd == LC_SEGMENT) {
+      auto *Seg = reinterpret_cast<const segment_command *>(Cmd);
+      if (!strncmp(Seg->segname, "__TEXT", sizeof(Seg->segname)))
+        Text = Seg;
+      else if (!strncmp(Seg->segname, "__LINKEDIT", sizeof(Seg->segname)))
+        LinkEdit = Seg;
+    }
+    Cmd = reinterpret_cast<const load_command *>(bytes(Cmd) + Cmd->cmdsize);
+  }
+  if (!Info || !Text || !LinkEdit)
+    return nullptr;
+  Size = Lazy ? Info->lazy_bind_size : Info->export_size;
+  if (!Size)
+    return nullptr;
+
+  // The info is referenced by its file offset.
+  uint64_t Slide = reinterpret_cast<uint64_t>(Hdr) - Text->vmaddr;
+  uint32_t Offset = Lazy ? Info->lazy_bind_off : Info->export_off;
+  return reinterpret_cast<const uint8_t *>(LinkEdit->vmaddr + Slide + Offset -
+                                           LinkEdit->fileoff);
+}
+
+// Inspired by `ImageLoaderMachOCompressed::findExportedSymbol` and `trieWalk`
+// from `dyld`.
+bool MachO::findExport(const char *Name, MachOExport &Export) {
+  using namespace llvm;
+  using namespace llvm::MachO;
+
+  uint64_t Size;
+  const uint8_t *Start = getDyldInfo(/* Lazy */ false, Size);
+  if (!Start)
+    return false;
+  const uint8_t *End = Start + Size;
+
+  auto ReadULEB = [End](const uint8_t *&P) {
+    unsigned Length;
+    uint64_t Result = decodeULEB128(P, &Length, End);
+    P += Length;
+    return Result;
+  };
+
+  // Walk the trie.
+  const uint8_t *P = Start;
+  for (;;) {
+    if (P >= End)
+      return false;
+    uint64_t TerminalSize = ReadULEB(P);
+    if (!*Name && TerminalSize)
+      break;
+    const uint8_t *Children = P + TerminalSize;
+    if (Children >= End)
+      return false;
+    uint8_t ChildCount = *Children++;
+    P = Children;
+    uint64_t NodeOffset = 0;
+    for (; ChildCount; --ChildCount) {
+      // Compare edge's label with prefix of `Name`.
+      const char *S = Name;
+      bool WrongEdge = false;
+      for (; P < End && *P; ++P)
+        if (!WrongEdge && *P != *S++)
+          WrongEdge = true;
+      ++P;
+      uint64_t Offset = ReadULEB(P);
+      if (!WrongEdge) {
+        NodeOffset = Offset;
+        Name = S;
+        break;
+      }
+    }
+    if (!NodeOffset || NodeOffset >= Size)
+      return false;
+    P = Start + NodeOffset;
+  }
+
+  // Read terminal information.
+  uint64_t Flags = ReadULEB(P);
+  if (Flags & EXPORT_SYMBOL_FLAGS_REEXPORT) {
+    Export.Addr = 0;
+    Export.Ordinal = ReadULEB(P);
+    Export.ImportName = reinterpret_cast<const char *>(P);
+    return true;
+  }
+  // Note that we ignore resolvers and bind stubs as `dyld` does without
+  // `RTLD_NOW`.
+  uint64_t Addr = ReadULEB(P);
+  switch (Flags & EXPORT_SYMBOL_FLAGS_KIND_MASK) {
+  case EXPORT_SYMBOL_FLAGS_KIND_REGULAR:
+    Export.Addr = reinterpret_cast<uint64_t>(Hdr) + Addr;
+    break;
+  case EXPORT_SYMBOL_FLAGS_KIND_ABSOLUTE:
+    Export.Addr = Addr;
+    break;
+  default:
+    // Thread-local symbols are not supported.
+    return false;
+  }
+  Export.Ordinal = 0;
+  Export.ImportName = nullptr;
+  return true;
+}
+
+// Inspired by `ImageLoaderMachOCompressed::getLazyBindingInfo` from `dyld`.
+bool MachO::findLazyBind(uint32_t Offset, DyldBind &Bind) {
+  using namespace llvm;
+  using namespace llvm::MachO;
+
+  uint64_t Size;
+  const uint8_t *Start = getDyldInfo(/* Lazy */ true, Size);
+  if (!Start || Offset >= Size)
+    return false;
+
+  // Collect segments (so that they can be indexed by binding opcodes).
+  SmallVector<DyldSegment, 8> Segments;
+  uint64_t Slide = 0;
+  auto *Header = reinterpret_cast<const mach_header *>(Hdr);
+  auto *Cmd = reinterpret_cast<const load_command *>(Header + 1);
+  for (size_t I = 0, IEnd = Header->ncmds; I != IEnd; ++I) {
+    if (Cmd->cmd == LC_SEGMENT) {
+      auto *Seg = reinterpret_cast<const segment_command *>(Cmd);
+      if (!strncmp(Seg->segname, "__TEXT", sizeof(Seg->segname)))
+        Slide = reinterpret_cast<uint64_t>(Hdr) - Seg->vmaddr;
+      Segments.push_back({Seg->vmaddr, Seg->vmsize});
+    }
+    Cmd = reinterpret_cast<const load_command *>(bytes(Cmd) + Cmd->cmdsize);
+  }
+  for (DyldSegment &Seg : Segments)
+    Seg.Addr += Slide;
+
+  // Interpret binding opcodes until the first bind. Note that we don't pass
+  // `Lazy` here, because `BIND_OPCODE_DONE` ends this lazy binding.
+  bool Found = false;
+  forEachBind(ArrayRef<uint8_t>(Start + Offset, Size - Offset), Segments,
+              /* Lazy */ false, [&](const DyldBind &B) {
+                Bind = B;
+                Found = true;
+                return false;
+              });
+  return Found;
+}
+
 namespace {
 
 struct method_t {
@@ -184,6 +365,10 @@ const char *ObjCMethod::getName() {
 const char *ObjCMethod::getType() {
   return reinterpret_cast<method_t *>(MethodData)->types;
 }
+uint64_t ObjCMethod::getImp() {
+  return reinterpret_cast<uint64_t>(
+      reinterpret_cast<method_t *>(MethodData)->imp);
+}
 const char *ObjCClass::getName() {
   if (Category)
     return reinterpret_cast<category_t *>(Data)->name;
@@ -235,7 +420,86 @@ ObjCMethod MachO::findMethod(const char *Section, uint64_t Addr) {
   return ObjCMethod();
 }
 
+atomic<uint64_t> ObjCMethodIndex::Realizations(0);
+
 ObjCMethod MachO::findMethod(uint64_t Addr) {
+  if (!Index)
+    return findMethodSlow(Addr);
+
+  if (!Index->Valid)
+    buildIndex();
+  auto I = Index->Methods.find(Addr);
+  if (I != Index->Methods.end() && I->second.getImp() == Addr)
+    return I->second;
+
+  // The method wasn't found or the runtime has moved it (it sorts method lists
+  // when realizing classes). If classes were realized since the index was
+  // built, rebuild it and try again.
+  if (I == Index->Methods.end() &&
+      Index->Generation == ObjCMethodIndex::Realizations)
+    return ObjCMethod();
+  buildIndex();
+  I = Index->Methods.find(Addr);
+  if (I != Index->Methods.end())
+    return I->second;
+  return ObjCMethod();
+}
+
+static void indexMethods(unordered_map<uint64_t, ObjCMethod> &Methods,
+                         method_list_t *List, bool Category, void *ClassData) {
+  if (!List)
+    return;
+  for (size_t J = 0; J != List->count; ++J) {
+    method_t &Method = List->methods[J];
+    // Don't overwrite existing entries, so that the results are the same as
+    // when searching linearly (see `MachO::findMethodSlow`).
+    Methods.emplace(reinterpret_cast<uint64_t>(Method.imp),
+                    ObjCMethod(Category, ClassData, &Method));
+  }
+}
+
+static void indexMethods(unordered_map<uint64_t, ObjCMethod> &Methods,
+                         objc_class *Class) {
+  indexMethods(Methods, Class->getInfo()->baseMethodList, /* Category */ false,
+               Class);
+  if (Class->isRealized())
+    for (auto *L = Class->data()->methods.beginLists(),
+              *End = Class->data()->methods.endLists();
+         L != End; ++L)
+      indexMethods(Methods, *L, /* Category */ false, Class);
+}
+
+void MachO::buildIndex() {
+  Index->Methods.clear();
+  Index->Generation = ObjCMethodIndex::Realizations;
+
+  // Index classes in the same order as `findMethodSlow` searches them.
+  for (const char *Section : {"__objc_classlist", "__objc_nlclslist"}) {
+    size_t Count;
+    if (auto *Classes =
+            getSectionData<objc_class *>(MachO::DataSegment, Section, &Count))
+      for (size_t I = 0; I != Count; ++I) {
+        objc_class *Class = Classes[I];
+        indexMethods(Index->Methods, Class);
+        indexMethods(Index->Methods, Class->isa);
+      }
+  }
+
+  size_t Count;
+  if (auto *Categories = getSectionData<category_t *>(MachO::DataSegment,
+                                                      "__objc_catlist", &Count))
+    for (size_t I = 0; I != Count; ++I) {
+      category_t *Category = Categories[I];
+      indexMethods(Index->Methods, Category->classMethods, /* Category */ true,
+                   Category);
+      indexMethods(Index->Methods, Category->instanceMethods,
+                   /* Category */ true, Category);
+    }
+
+  Index->Valid = true;
+}
+
+ObjCMethod MachO::findMethodSlow(uint64_t Addr) {
   // Enumerate classes in the image.
   if (ObjCMethod M = findMethod("__objc_classlist", Addr))
     return M;
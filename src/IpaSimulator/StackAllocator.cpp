@@ -0,0 +1,119 @@
+// StackAllocator.cpp: Implementation of class `StackAllocator`.
+
+#include "ipasim/StackAllocator.hpp"
+
+#include "ipasim/Emulator.hpp"
+#include "ipasim/IpaSimulator.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
+
+#include <Windows.h>
+#include <algorithm>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+StackAllocator *Instance; // Used by `handleException`
+
+// Native code (e.g., callbacks writing through pointers to guest locals)
+// accesses guest stacks directly, without faulting in emulators. Its accesses
+// below the committed part of the stack are handled here.
+LONG CALLBACK handleException(EXCEPTION_POINTERS *Info) {
+  EXCEPTION_RECORD *Rec = Info->ExceptionRecord;
+  if (Rec->ExceptionCode != EXCEPTION_ACCESS_VIOLATION ||
+      Rec->NumberParameters < 2)
+    return EXCEPTION_CONTINUE_SEARCH;
+  uint64_t Addr = Rec->ExceptionInformation[1];
+  if (Instance->grow(Addr) == StackAllocator::GrowResult::Grown)
+    return EXCEPTION_CONTINUE_EXECUTION;
+  return EXCEPTION_CONTINUE_SEARCH;
+}
+
+} // namespace
+
+StackAllocator::StackAllocator() {
+  Instance = this;
+  AddVectoredExceptionHandler(/* First */ 1, handleException);
+}
+
+StackAllocator::Stack *StackAllocator::allocate(size_t Size) {
+  Size = (Size + Granularity - 1) & ~(Granularity - 1);
+  lock_guard<mutex> Lock(Mutex);
+
+  // Reuse released stack if possible. Its committed pages are kept, because
+  // the new owner is likely to need them, too.
+  auto I = find_if(Free.begin(), Free.end(),
+                   [Size](Stack *S) { return S->High - S->Low == Size; });
+  if (I != Free.end()) {
+    Stack *S = *I;
+    *I = Free.back();
+    Free.pop_back();
+    return S;
+  }
+
+  // Reserve the stack together with its guard (which is never committed).
+  auto Base = reinterpret_cast<uint64_t>(
+      VirtualAllocFromApp(nullptr, GuardSize + Size, MEM_RESERVE,
+                          PAGE_READWRITE));
+  if (!Base) {
+    Log.error("couldn't reserve guest stack");
+    return nullptr;
+  }
+  auto S = make_unique<Stack>();
+  S->Low = Base + GuardSize;
+  S->High = S->Low + Size;
+
+  // Commit the top of the stack right away, so that the owner doesn't fault
+  // immediately.
+  uint64_t Top = S->High - CommitChunk;
+  if (!VirtualAllocFromApp(reinterpret_cast<void *>(Top), CommitChunk,
+                           MEM_COMMIT, PAGE_READWRITE)) {
+    Log.error("couldn't commit guest stack");
+    VirtualFree(reinterpret_cast<void *>(Base), 0, MEM_RELEASE);
+    return nullptr;
+  }
+  Emulator::mapMemory(Top, CommitChunk, UC_PROT_READ | UC_PROT_WRITE);
+  S->Committed = Top;
+
+  if constexpr (PrintEmuInfo)
+    Log.info() << "reserved guest stack at 0x" << to_hex_string(S->Low)
+               << " of size 0x" << to_hex_string(Size) << Log.end();
+  return Stacks.emplace(Base, move(S)).first->second.get();
+}
+
+void StackAllocator::release(Stack *S) {
+  lock_guard<mutex> Lock(Mutex);
+  Free.push_back(S);
+}
+
+StackAllocator::GrowResult StackAllocator::grow(uint64_t Addr) {
+  lock_guard<mutex> Lock(Mutex);
+  auto I = Stacks.upper_bound(Addr);
+  if (I == Stacks.begin())
+    return GrowResult::NotStack;
+  Stack &S = *prev(I)->second;
+  if (Addr >= S.High)
+    return GrowResult::NotStack;
+  if (Addr < S.Low) {
+    Log.error() << "guest stack overflow at 0x" << to_hex_string(Addr)
+                << Log.end();
+    return GrowResult::Overflow;
+  }
+
+  // Another thread could have grown the stack already.
+  if (Addr >= S.Committed)
+    return GrowResult::Grown;
+
+  // Commit whole chunks, so that the guest doesn't fault on every page.
+  uint64_t Start = Addr & ~(CommitChunk - 1);
+  uint64_t Size = S.Committed - Start;
+  if (!VirtualAllocFromApp(reinterpret_cast<void *>(Start), Size, MEM_COMMIT,
+                           PAGE_READWRITE)) {
+    Log.error("couldn't commit guest stack");
+    return GrowResult::Overflow;
+  }
+  Emulator::mapMemory(Start, Size, UC_PROT_READ | UC_PROT_WRITE);
+  S.Committed = Start;
+  return GrowResult::Grown;
+}
@@ -0,0 +1,79 @@
+// SymbolIndex.cpp: Implementation of classes `StringPool` and `SymbolIndex`.
+
+#include "ipasim/SymbolIndex.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+
+using namespace ipasim;
+using namespace std;
+
+const char *StringPool::intern(string_view S) {
+  auto I = Strings.find(S);
+  if (I != Strings.end())
+    return I->data();
+
+  // Allocate new block if needed. Long strings get their own block.
+  size_t Size = S.size() + 1;
+  if (BlockUsed + Size > BlockSize) {
+    Blocks.push_back(make_unique<char[]>(max(Size, BlockSize)));
+    BlockUsed = 0;
+  }
+
+  char *Str = Blocks.back().get() + BlockUsed;
+  memcpy(Str, S.data(), S.size());
+  Str[S.size()] = '\0';
+  BlockUsed += Size;
+  Strings.insert(string_view(Str, S.size()));
+  return Str;
+}
+
+namespace {
+
+struct CompareRVA {
+  using Entry = SymbolIndex::Entry;
+
+  bool operator()(const Entry &A, const Entry &B) const {
+    return A.RVA < B.RVA;
+  }
+  bool operator()(const Entry &E, uint32_t RVA) const { return E.RVA < RVA; }
+  bool operator()(uint32_t RVA, const Entry &E) const { return RVA < E.RVA; }
+};
+
+} // namespace
+
+void SymbolIndex::finish() {
+  stable_sort(Entries.begin(), Entries.end(), CompareRVA());
+  Entries.shrink_to_fit();
+
+  ByName.resize(Entries.size());
+  iota(ByName.begin(), ByName.end(), 0);
+  stable_sort(ByName.begin(), ByName.end(), [this](uint32_t A, uint32_t B) {
+    return strcmp(Entries[A].Name, Entries[B].Name) < 0;
+  });
+}
+
+SymbolIndex::EntryRange SymbolIndex::findExact(uint32_t RVA) const {
+  auto [Begin, End] =
+      equal_range(Entries.begin(), Entries.end(), RVA, CompareRVA());
+  return {Entries.data() + (Begin - Entries.begin()),
+          Entries.data() + (End - Entries.begin())};
+}
+
+const SymbolIndex::Entry *SymbolIndex::findPreceding(uint32_t RVA) const {
+  auto I = upper_bound(Entries.begin(), Entries.end(), RVA, CompareRVA());
+  if (I == Entries.begin())
+    return nullptr;
+  return &*prev(I);
+}
+
+const SymbolIndex::Entry *SymbolIndex::findByName(const char *Name) const {
+  auto I = lower_bound(ByName.begin(), ByName.end(), Name,
+                       [this](uint32_t Idx, const char *Name) {
+                         return strcmp(Entries[Idx].Name, Name) < 0;
+                       });
+  if (I == ByName.end() || strcmp(Entries[*I].Name, Name))
+    return nullptr;
+  return &Entries[*I];
+}
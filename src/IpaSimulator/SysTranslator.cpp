@@ -1,5 +1,5 @@
-// SysTranslator.cpp: Implementation of classes `SysTranslator`, `DynamicCaller`
-// and `TypeDecoder`.
+// SysTranslator.cpp: Implementation of classes `SysTranslator` and
+// `DynamicCaller`.
 
 #include "ipasim/SysTranslator.hpp"
 
@@ -8,23 +8,13 @@
 #include "ipasim/IpaSimulator/Config.hpp"
 #include "ipasim/WrapperIndex.hpp"
 
+#include <cstdlib>
 #include <filesystem>
 #include <thread>
 
 using namespace ipasim;
 using namespace std;
 
-namespace {
-
-struct Trampoline {
-  ffi_cif CIF;
-  bool Returns;
-  size_t ArgC;
-  uint64_t Addr;
-};
-
-} // namespace
-
 void SysTranslator::execute(LoadedLibrary *Lib) {
   auto *Dylib = dynamic_cast<LoadedDylib *>(Lib);
   if (!Dylib) {
@@ -32,30 +22,6 @@ void SysTranslator::execute(LoadedLibrary *Lib) {
     return;
   }
 
-  // Initialize the stack.
-  size_t StackSize = 8 * 1024 * 1024; // 8 MiB
-  void *StackPtr = _aligned_malloc(StackSize, DynamicLoader::PageSize);
-  uint64_t StackAddr = reinterpret_cast<uint64_t>(StackPtr);
-  Emu.mapMemory(StackAddr, StackSize, UC_PROT_READ | UC_PROT_WRITE);
-  // Reserve 12 bytes on the stack, so that our instruction logger can read
-  // them.
-  Emu.writeReg(UC_ARM_REG_SP, StackAddr + StackSize - 12);
-
-  // Install hooks.
-  // This hook handles calls across platform boundaries (iOS -> Windows). It
-  // works thanks to mapping Windows DLLs as non-executable.
-  Emu.hook(UC_HOOK_MEM_FETCH_PROT, &SysTranslator::handleFetchProtMem, this);
-  if constexpr (PrintInstructions)
-    // This hook logs execution for debugging purposes.
-    Emu.hook(UC_HOOK_CODE, &SysTranslator::handleCode, this);
-  if constexpr (PrintMemoryWrites)
-    // This hook logs all memory writes.
-    Emu.hook(UC_HOOK_MEM_WRITE, &SysTranslator::handleMemWrite, this);
-  // This hook allows through reading and writing to unmapped memory (probably
-  // heap or other external objects).
-  Emu.hook(UC_HOOK_MEM_READ_UNMAPPED | UC_HOOK_MEM_WRITE_UNMAPPED,
-           &SysTranslator::handleMemUnmapped, this);
-
   // TODO: Do this also for all non-wrapper Dylibs (i.e., Dylibs that come with
   // the `.ipa` file).
   // TODO: Call also other (user) C++ initializers.
@@ -66,63 +32,218 @@ void SysTranslator::execute(LoadedLibrary *Lib) {
   call("libobjc.dll", "_objc_init");
 
   // Start at entry point.
-  execute(Dylib->Bin.entrypoint() + Dylib->StartAddress);
+  execute(Dylib->Entrypoint + Dylib->StartAddress);
+}
+
+// Returns execution context of the calling thread. The first thread that
+// executes guest code uses the main engine, other threads get their own.
+SysTranslator::ThreadContext &SysTranslator::getContext() {
+  // Note that there is only one `SysTranslator`, so this can be static.
+  thread_local ContextHolder Holder;
+  if (!Holder.Ctx) {
+    Holder.Sys = this;
+    Holder.Ctx = acquireContext();
+    if (!Holder.Ctx) {
+      // There is no way to run guest code without a stack.
+      Log.error("couldn't create execution context");
+      abort();
+    }
+  }
+  return *Holder.Ctx;
+}
+
+SysTranslator::ContextHolder::~ContextHolder() {
+  if (Ctx && Ctx->OwnEmu)
+    Sys->releaseContext(move(Ctx));
+}
+
+unique_ptr<SysTranslator::ThreadContext> SysTranslator::acquireContext() {
+  if (!MainContextTaken.exchange(true))
+    return createContext(/* Main */ true);
+
+  // Prefer a prepared context, so that the thread can start right away.
+  unique_ptr<ThreadContext> Ctx;
+  {
+    lock_guard<mutex> Lock(PoolMutex);
+    if (!ContextPool.empty()) {
+      Ctx = move(ContextPool.back());
+      ContextPool.pop_back();
+    }
+  }
+  if (!Ctx)
+    return createContext(/* Main */ false);
+
+  if constexpr (PrintEmuInfo)
+    Log.info() << "reusing execution context for thread "
+               << this_thread::get_id() << Log.end();
+  // Map memory mapped since the context was created (or last used).
+  Ctx->Emu.sync();
+  return Ctx;
+}
+
+unique_ptr<SysTranslator::ThreadContext>
+SysTranslator::createContext(bool Main) {
+  unique_ptr<Emulator> OwnEmu;
+  if (!Main)
+    OwnEmu = make_unique<Emulator>(Dyld);
+  auto Ctx = make_unique<ThreadContext>(OwnEmu ? *OwnEmu : Emu);
+  Ctx->OwnEmu = move(OwnEmu);
+  if constexpr (PrintEmuInfo)
+    Log.info() << "creating execution context in thread "
+               << this_thread::get_id() << Log.end();
+
+  // Initialize the stack. Secondary threads get smaller stacks (as on iOS).
+  Ctx->Stack = Stacks.allocate(Main ? MainStackSize : SecondaryStackSize);
+  if (!Ctx->Stack) {
+    Log.error("couldn't allocate guest stack");
+    return nullptr;
+  }
+  Ctx->MsgCache = Dyld.allocateMsgCache();
+  Ctx->reset();
+
+  installHooks(Ctx->Emu);
+  return Ctx;
+}
+
+void SysTranslator::releaseContext(unique_ptr<ThreadContext> &&Ctx) {
+  Ctx->reset();
+  lock_guard<mutex> Lock(PoolMutex);
+  if (ContextPool.size() < ContextPoolSize)
+    ContextPool.push_back(move(Ctx));
+  else {
+    Stacks.release(Ctx->Stack);
+    Dyld.releaseMsgCache(Ctx->MsgCache);
+  }
+}
+
+void SysTranslator::prewarmContexts() {
+  if constexpr (ContextPoolSize == 0)
+    return;
+
+  thread([this]() {
+    for (size_t I = 0; I != ContextPoolSize; ++I) {
+      unique_ptr<ThreadContext> Ctx = createContext(/* Main */ false);
+      if (!Ctx)
+        return;
+      // Map everything that's been loaded so far, so that threads borrowing
+      // the context have (almost) nothing left to do.
+      Ctx->Emu.sync();
+
+      lock_guard<mutex> Lock(PoolMutex);
+      if (ContextPool.size() == ContextPoolSize) {
+        Stacks.release(Ctx->Stack);
+        Dyld.releaseMsgCache(Ctx->MsgCache);
+        return;
+      }
+      ContextPool.push_back(move(Ctx));
+    }
+  }).detach();
+}
+
+void SysTranslator::installHooks(Emulator &E) {
+  // This hook handles calls across platform boundaries (iOS -> Windows). It
+  // works thanks to mapping Windows DLLs as non-executable.
+  E.hook(UC_HOOK_MEM_FETCH_PROT, &SysTranslator::handleFetchProtMem, this);
+  // This hook handles the same calls if they go through `svc` stubs instead.
+  E.hook(UC_HOOK_INTR, &SysTranslator::handleInterrupt, this);
+  if constexpr (PrintInstructions)
+    // This hook logs execution for debugging purposes.
+    E.hook(UC_HOOK_CODE, &SysTranslator::handleCode, this);
+  if constexpr (PrintMemoryWrites)
+    // This hook logs all memory writes.
+    E.hook(UC_HOOK_MEM_WRITE, &SysTranslator::handleMemWrite, this);
+  // This hook allows through reading and writing to unmapped memory (probably
+  // heap or other external objects).
+  E.hook(UC_HOOK_MEM_READ_UNMAPPED | UC_HOOK_MEM_WRITE_UNMAPPED,
+         &SysTranslator::handleMemUnmapped, this);
+  // This hook maps code mapped by other threads (or deferred by
+  // `DynamicLoader`) when it's executed.
+  E.hook(UC_HOOK_MEM_FETCH_UNMAPPED, &SysTranslator::handleFetchUnmapped,
+         this);
+}
+
+// Prepares the context for executing guest code from scratch.
+void SysTranslator::ThreadContext::reset() {
+  LRs = {};
+  Restart = Continue = RestartFromLRs = ReturnedToKernel = false;
+  RestartAddr = 0;
+  Continuation = nullptr;
+  // Reserve 12 bytes on the stack, so that our instruction logger can read
+  // them.
+  Emu.writeReg(UC_ARM_REG_SP, Stack->High - 12);
+  // The guest messenger finds the method cache here.
+  Emu.writeReg(UC_ARM_REG_C13_C0_3, MsgCache);
 }
 
 void SysTranslator::execute(uint64_t Addr) {
+  ThreadContext &Ctx = getContext();
+
   if constexpr (PrintEmuInfo)
     Log.info() << "starting emulation at " << Dyld.dumpAddr(Addr)
                << " in thread " << this_thread::get_id() << Log.end();
 
   // Save LR.
-  LRs.push(Emu.readReg(UC_ARM_REG_LR));
+  Ctx.LRs.push(Ctx.Emu.readReg(UC_ARM_REG_LR));
 
   // Point return address to kernel.
-  Emu.writeReg(UC_ARM_REG_LR, Dyld.getKernelAddr());
+  Ctx.Emu.writeReg(UC_ARM_REG_LR, Dyld.getKernelAddr());
 
-  // Start execution.
+  // Start execution. Emulation stops at the kernel address when the function
+  // returns (if `ReturnViaUntil` is disabled, it faults there instead, see
+  // `handleFetchProtMem`).
   for (;;) {
-    Emu.start(Addr);
+    Ctx.Emu.start(Addr, ReturnViaUntil ? Dyld.getKernelAddr() : 0);
 
-    if (Continue) {
-      Continue = false;
-      Continuation();
-      Continuation = nullptr;
+    if (Ctx.Continue) {
+      Ctx.Continue = false;
+      Ctx.Continuation();
+      Ctx.Continuation = nullptr;
     }
 
-    if (Restart) {
+    if (Ctx.Restart) {
       // If restarting, continue where we left off.
-      Restart = false;
-      if (RestartFromLRs) {
-        RestartFromLRs = false;
-        Addr = LRs.top();
-        LRs.pop();
+      Ctx.Restart = false;
+      if (Ctx.RestartAddr) {
+        Addr = Ctx.RestartAddr;
+        Ctx.RestartAddr = 0;
+      } else if (Ctx.RestartFromLRs) {
+        Ctx.RestartFromLRs = false;
+        Addr = Ctx.LRs.top();
+        Ctx.LRs.pop();
       } else
-        Addr = Emu.readReg(UC_ARM_REG_LR);
+        Addr = Ctx.Emu.readReg(UC_ARM_REG_LR);
     } else
       break;
   }
+
+  // If we stopped cleanly at the kernel address, nobody has called
+  // `returnToKernel` yet.
+  if (Ctx.ReturnedToKernel)
+    Ctx.ReturnedToKernel = false;
+  else if (Ctx.Emu.readReg(UC_ARM_REG_PC) == Dyld.getKernelAddr())
+    returnToKernel();
 }
 
 void SysTranslator::returnToKernel() {
+  ThreadContext &Ctx = getContext();
+
   if constexpr (PrintEmuInfo)
     Log.info() << "executing kernel at 0x"
                << to_hex_string(Dyld.getKernelAddr()) << Log.end();
 
   // Restore LR.
-  Emu.writeReg(UC_ARM_REG_LR, LRs.top());
-  LRs.pop();
-
-  // Stop execution.
-  Emu.stop();
+  Ctx.Emu.writeReg(UC_ARM_REG_LR, Ctx.LRs.top());
+  Ctx.LRs.pop();
 }
 
 void SysTranslator::returnToEmulation() {
+  ThreadContext &Ctx = getContext();
+
   if constexpr (PrintEmuInfo)
-    Log.info() << "returning to " << Dyld.dumpAddr(Emu.readReg(UC_ARM_REG_LR))
-               << Log.end();
+    Log.info() << "returning to "
+               << Dyld.dumpAddr(Ctx.Emu.readReg(UC_ARM_REG_LR)) << Log.end();
 
-  Restart = true;
+  Ctx.Restart = true;
 }
 
 // Calling `uc_emu_start` inside `uc_emu_start` (e.g., inside a hook) is not
@@ -132,11 +253,13 @@ void SysTranslator::returnToEmulation() {
 // using this function. See also
 // <https://github.com/unicorn-engine/unicorn/issues/591>.
 void SysTranslator::continueOutsideEmulation(function<void()> &&Cont) {
-  assert(!Continue && "Only one continuation is supported.");
-  Continue = true;
-  Continuation = move(Cont);
+  ThreadContext &Ctx = getContext();
 
-  Emu.stop();
+  assert(!Ctx.Continue && "Only one continuation is supported.");
+  Ctx.Continue = true;
+  Ctx.Continuation = move(Cont);
+
+  Ctx.Emu.stop();
 }
 
 // Note that we never return `true` from this handler, so that protected memory
@@ -144,14 +267,131 @@ void SysTranslator::continueOutsideEmulation(function<void()> &&Cont) {
 // memory, and it would get into the cache, effectively becoming unprotected.
 bool SysTranslator::handleFetchProtMem(uc_mem_type Type, uint64_t Addr,
                                        int Size, int64_t Value) {
+  ThreadContext &Ctx = getContext();
+
   // Handle return to kernel.
   if (Addr == Dyld.getKernelAddr()) {
     returnToKernel();
+    Ctx.ReturnedToKernel = true;
+    Ctx.Emu.stop();
+
+    Ctx.Emu.ignoreNextError();
+    return false;
+  }
 
-    Emu.ignoreNextError();
+  // The memory could have been mapped as code by another thread since (e.g.,
+  // generated code placed where data were mapped before). Then it's not a call
+  // into the host, so restart emulation there once the fault is over.
+  Ctx.Emu.sync();
+  if (Ctx.Emu.isExecutable(Addr)) {
+    bool Thumb = Ctx.Emu.readReg(UC_ARM_REG_CPSR) & CpsrThumb;
+    Ctx.Restart = true;
+    Ctx.RestartAddr = Addr | Thumb;
+    Ctx.Emu.stop();
+
+    Ctx.Emu.ignoreNextError();
     return false;
   }
 
+  const DispatchTarget *Target = findDispatchTarget(Addr);
+  if (Target && dispatch(Addr, *Target, /* Svc */ false))
+    Ctx.Emu.ignoreNextError();
+  return false;
+}
+
+// This hook handles calls through `svc` stubs generated by `DynamicLoader` (see
+// `DynamicLoader::setSvcDispatch`). Contrary to `handleFetchProtMem`, no
+// Unicorn error is produced, so there is nothing to ignore.
+void SysTranslator::handleInterrupt(uint32_t IntNo) {
+  ThreadContext &Ctx = getContext();
+
+  if (IntNo != ExcpSwi) {
+    Log.error() << "unexpected interrupt " << IntNo << " at "
+                << Dyld.dumpAddr(Ctx.Emu.readReg(UC_ARM_REG_PC)) << Log.end();
+    Ctx.Emu.stop();
+    return;
+  }
+
+  // PC already points after the `svc` instruction.
+  uint32_t PC = Ctx.Emu.readReg(UC_ARM_REG_PC);
+  if (PC - 4 == Dyld.getStubBinder()) {
+    handleStubBinder();
+    return;
+  }
+
+  // Immediate operand of the `svc` instruction is index into the table of stub
+  // targets.
+  uint32_t Insn = *reinterpret_cast<uint32_t *>(PC - 4);
+  uint64_t Addr = Dyld.getSvcTarget(Insn & 0xFFFFFF);
+  if (!Addr) {
+    Log.error() << "invalid svc stub at 0x" << to_hex_string(PC - 4)
+                << Log.end();
+    Ctx.Emu.stop();
+    return;
+  }
+
+  if constexpr (PrintEmuInfo)
+    Log.info() << "svc to " << Dyld.dumpAddr(Addr) << Log.end();
+
+  // Note that `LR` was not changed by the stub, so the dispatched call will
+  // return directly to the caller.
+  const DispatchTarget *Target = findDispatchTarget(Addr);
+  if (!Target || !dispatch(Addr, *Target, /* Svc */ true))
+    Ctx.Emu.stop();
+}
+
+// Emulates `dyld_stub_binder`. Stub helpers push two words (see
+// `DynamicLoader::bindLazySymbol`), pop them and continue at the bound address
+// as if it was called directly (i.e., with the original arguments and `LR`).
+void SysTranslator::handleStubBinder() {
+  ThreadContext &Ctx = getContext();
+
+  uint32_t SP = Ctx.Emu.readReg(UC_ARM_REG_SP);
+  auto *Args = reinterpret_cast<const uint32_t *>(SP);
+  uint64_t Addr = Dyld.bindLazySymbol(Args[0], Args[1]);
+  if (!Addr) {
+    Ctx.Emu.stop();
+    return;
+  }
+
+  // If `Addr` is in a DLL, fetching it faults and is handled as any other call
+  // across the platform boundary.
+  Ctx.Emu.writeReg(UC_ARM_REG_SP, SP + 8);
+  Ctx.Emu.writeReg(UC_ARM_REG_PC, Addr);
+}
+
+const SysTranslator::DispatchTarget *
+SysTranslator::findDispatchTarget(uint64_t Addr) {
+  ThreadContext &Ctx = getContext();
+
+  // Consult the dispatch cache first.
+  auto Entry = Ctx.DispatchCache.find(Addr);
+  if (Entry != Ctx.DispatchCache.end() &&
+      Ctx.DispatchGeneration == Dyld.getGeneration()) {
+    if constexpr (PrintEmuInfo)
+      Log.info() << "dispatching to " << Dyld.dumpAddr(Addr) << " (cached)"
+                 << Log.end();
+    return &Entry->second;
+  }
+
+  DispatchTarget Target;
+  if (!resolveDispatchTarget(Addr, Target))
+    return nullptr;
+
+  // Resolving could have loaded new libraries, so invalidate the cache only
+  // now.
+  if (Ctx.DispatchGeneration != Dyld.getGeneration()) {
+    Ctx.DispatchCache.clear();
+    Ctx.DispatchGeneration = Dyld.getGeneration();
+  }
+  return &Ctx.DispatchCache.insert_or_assign(Addr, move(Target)).first->second;
+}
+
+bool SysTranslator::resolveDispatchTarget(uint64_t Addr,
+                                          DispatchTarget &Target) {
+  // Libraries (and `LeafWrappers`) are used directly, so hold the loader lock.
+  auto DyldLock = Dyld.lock();
+
   // Check that the target address is in some loaded library.
   LibraryInfo LI(Dyld.lookup(Addr));
   if (!LI.Lib) {
@@ -175,20 +415,10 @@ bool SysTranslator::handleFetchProtMem(uc_mem_type Type, uint64_t Addr,
   }
 
   if (Wrapper) {
-    // Read register R0 containing address of our structure with function
-    // arguments and return value.
-    uint32_t R0 = Emu.readReg(UC_ARM_REG_R0);
-
-    continueOutsideEmulation([=]() {
-      // Call the target function.
-      auto *Func = reinterpret_cast<void (*)(uint32_t)>(Addr);
-      Func(R0);
-
-      returnToEmulation();
-    });
-
-    Emu.ignoreNextError();
-    return false;
+    Target.Kind = DispatchTarget::WrapperDLL;
+    Target.Addr = Addr;
+    Target.Leaf = isLeafWrapper(LI.Lib, Addr);
+    return true;
   }
 
   // If the target is not a wrapper DLL, we must find and call the corresponding
@@ -204,8 +434,7 @@ bool SysTranslator::handleFetchProtMem(uc_mem_type Type, uint64_t Addr,
   }
 
   // Load `WrapperIndex`.
-  uint64_t IdxAddr =
-      WrapperLib->findSymbol(Dyld, "?Idx@@3UWrapperIndex@ipasim@@A");
+  uint64_t IdxAddr = WrapperLib->findSymbol(Dyld, IdxSymbol);
   auto *Idx = reinterpret_cast<WrapperIndex *>(IdxAddr);
 
   uint64_t RVA = Addr - LI.Lib->StartAddress + DLLBase;
@@ -221,26 +450,21 @@ bool SysTranslator::handleFetchProtMem(uc_mem_type Type, uint64_t Addr,
     }
 
     // Find the correct wrapper using its alias.
-    Addr = WrapperDylib->findSymbol(
+    uint64_t WrapperAddr = WrapperDylib->findSymbol(
         Dyld, WrapsPrefix.S + DLLPath.stem().string() + "_" + to_string(RVA));
-    if (!Addr) {
+    if (!WrapperAddr) {
       Log.error() << "cannot find wrapper for 0x" << to_hex_string(RVA)
                   << " in " << *LI.LibPath << Log.end();
       return false;
     }
 
     if constexpr (PrintEmuInfo)
-      Log.info() << "found wrapper at " << Dyld.dumpAddr(Addr) << Log.end();
-
-    // Note that doing just `Emu.writeReg(UC_ARM_REG_PC, Addr);` instead of all
-    // this didn't work in Release mode for some reason.
-    Emu.stop();
-    Restart = true;
-    RestartFromLRs = true;
-    LRs.push(Addr);
+      Log.info() << "found wrapper at " << Dyld.dumpAddr(WrapperAddr)
+                 << Log.end();
 
-    Emu.ignoreNextError();
-    return false;
+    Target.Kind = DispatchTarget::Wrapper;
+    Target.Addr = WrapperAddr;
+    return true;
   }
 
   // If there's no corresponding wrapper, maybe this is a simple Objective-C
@@ -256,57 +480,113 @@ bool SysTranslator::handleFetchProtMem(uc_mem_type Type, uint64_t Addr,
     Log.info() << "dynamically handling method " << Dyld.dumpAddr(Addr, LI, M)
                << Log.end();
 
-  // Handle return value.
-  TypeDecoder TD(M.getType());
-  bool Returns;
-  switch (TD.getNextTypeSize()) {
-  case 0:
-    Returns = false;
-    break;
-  case 4:
-    Returns = true;
-    break;
-  default:
-    Log.error() << "unsupported return type of " << Dyld.dumpAddr(Addr, LI, M)
+  Target.Plan = Types.getCallPlan(M.getType());
+  if (!Target.Plan) {
+    Log.error() << "unsupported signature of " << Dyld.dumpAddr(Addr, LI, M)
                 << Log.end();
     return false;
   }
 
-  // Process function arguments.
-  auto DC = make_unique<DynamicCaller>(Emu);
-  while (TD.hasNext()) {
-    size_t Size = TD.getNextTypeSize();
-    if (Size == TypeDecoder::InvalidSize)
-      return false;
-    DC->loadArg(Size);
+  Target.Kind = DispatchTarget::Dynamic;
+  Target.Addr = Addr;
+  return true;
+}
+
+bool SysTranslator::isLeafWrapper(LoadedLibrary *WrapperLib, uint64_t Addr) {
+  auto I = LeafWrappers.find(WrapperLib);
+  if (I == LeafWrappers.end()) {
+    // Find addresses of all leaf wrappers in the library.
+    unordered_set<uint64_t> Leaves;
+    if (uint64_t IdxAddr = WrapperLib->findSymbol(Dyld, IdxSymbol)) {
+      auto *Idx = reinterpret_cast<WrapperIndex *>(IdxAddr);
+      for (uint32_t RVA : Idx->Leaves)
+        if (uint64_t LeafAddr = WrapperLib->findSymbol(
+                Dyld, WrapperPrefix.S + to_string(RVA)))
+          Leaves.insert(LeafAddr);
+    }
+    I = LeafWrappers.emplace(WrapperLib, move(Leaves)).first;
   }
+  return I->second.count(Addr);
+}
 
-  continueOutsideEmulation([=, DCP = DC.release()]() {
-    unique_ptr<DynamicCaller> DC(DCP);
+// If `Svc` is `true`, we are inside an interrupt hook (see `handleInterrupt`).
+// Otherwise, we are handling a fetch-protection fault.
+bool SysTranslator::dispatch(uint64_t Addr, const DispatchTarget &Target,
+                             bool Svc) {
+  ThreadContext &Ctx = getContext();
 
-    // Call the function.
-    if (!DC->call(Returns, Addr))
-      return;
+  switch (Target.Kind) {
+  case DispatchTarget::WrapperDLL: {
+    // Read register R0 containing address of our structure with function
+    // arguments and return value.
+    uint32_t R0 = Ctx.Emu.readReg(UC_ARM_REG_R0);
+
+    // Leaf functions cannot call back into emulated code (i.e., cannot start
+    // Unicorn again), so we can call them directly.
+    if (Target.Leaf) {
+      reinterpret_cast<void (*)(uint32_t)>(Addr)(R0);
+
+      // If we came from the `svc` stub, it will return to the caller by
+      // itself. Otherwise, emulation must be restarted.
+      if (!Svc) {
+        returnToEmulation();
+        Ctx.Emu.stop();
+      }
+      return true;
+    }
 
-    returnToEmulation();
-  });
+    continueOutsideEmulation([=]() {
+      // Call the target function.
+      auto *Func = reinterpret_cast<void (*)(uint32_t)>(Addr);
+      Func(R0);
 
-  Emu.ignoreNextError();
+      returnToEmulation();
+    });
+    return true;
+  }
+  case DispatchTarget::Wrapper:
+    // Note that doing just `Emu.writeReg(UC_ARM_REG_PC, Addr);` instead of all
+    // this didn't work in Release mode for some reason.
+    Ctx.Emu.stop();
+    Ctx.Restart = true;
+    Ctx.RestartFromLRs = true;
+    Ctx.LRs.push(Target.Addr);
+    return true;
+  case DispatchTarget::Dynamic: {
+    // Process function arguments.
+    auto DC = make_unique<DynamicCaller>(Ctx.Emu, *Target.Plan);
+
+    continueOutsideEmulation([=, DCP = DC.release()]() {
+      unique_ptr<DynamicCaller> DC(DCP);
+
+      // Call the function.
+      DC->call(Addr);
+
+      returnToEmulation();
+    });
+    return true;
+  }
+  }
   return false;
 }
 
 void SysTranslator::handleCode(uint64_t Addr, uint32_t Size) {
-  auto *R13 = reinterpret_cast<uint32_t *>(Emu.readReg(UC_ARM_REG_R13));
+  ThreadContext &Ctx = getContext();
+
+  static constexpr uc_arm_reg RegIds[] = {
+      UC_ARM_REG_R0,  UC_ARM_REG_R1,  UC_ARM_REG_R7,
+      UC_ARM_REG_R12, UC_ARM_REG_R13, UC_ARM_REG_R14};
+  uint32_t Regs[size(RegIds)];
+  Ctx.Emu.readRegs(RegIds, Regs, size(RegIds));
+  auto *R13 = reinterpret_cast<uint32_t *>(Regs[4]);
   Log.info() << "executing at " << Dyld.dumpAddr(Addr) << " [R0 = 0x"
-             << to_hex_string(Emu.readReg(UC_ARM_REG_R0)) << ", R1 = 0x"
-             << to_hex_string(Emu.readReg(UC_ARM_REG_R1)) << ", R7 = 0x"
-             << to_hex_string(Emu.readReg(UC_ARM_REG_R7)) << ", R12 = 0x"
-             << to_hex_string(Emu.readReg(UC_ARM_REG_R12)) << ", R13 = 0x"
-             << to_hex_string(Emu.readReg(UC_ARM_REG_R13)) << ", [R13] = 0x"
-             << to_hex_string(R13[0]) << ", [R13+4] = 0x"
+             << to_hex_string(Regs[0]) << ", R1 = 0x" << to_hex_string(Regs[1])
+             << ", R7 = 0x" << to_hex_string(Regs[2]) << ", R12 = 0x"
+             << to_hex_string(Regs[3]) << ", R13 = 0x" << to_hex_string(Regs[4])
+             << ", [R13] = 0x" << to_hex_string(R13[0]) << ", [R13+4] = 0x"
              << to_hex_string(R13[1]) << ", [R13+8] = 0x"
-             << to_hex_string(R13[2]) << ", R14 = 0x"
-             << to_hex_string(Emu.readReg(UC_ARM_REG_R14)) << "]" << Log.end();
+             << to_hex_string(R13[2]) << ", R14 = 0x" << to_hex_string(Regs[5])
+             << "]" << Log.end();
 }
 
 bool SysTranslator::handleMemWrite(uc_mem_type Type, uint64_t Addr, int Size,
@@ -321,19 +601,68 @@ bool SysTranslator::handleMemWrite(uc_mem_type Type, uint64_t Addr, int Size,
 // dependent DLL and we should load it as a whole.
 bool SysTranslator::handleMemUnmapped(uc_mem_type Type, uint64_t Addr, int Size,
                                       int64_t Value) {
+  Emulator &E = getContext().Emu;
   if constexpr (PrintEmuInfo)
     Log.info() << "unmapped memory manipulation at " << Dyld.dumpAddr(Addr)
                << " (" << Size << ")" << Log.end();
 
-  // Map the memory, so that emulation can continue.
+  // The memory could have been mapped by another thread.
+  if (E.sync())
+    return true;
+
+  // The guest stack can grow into pages that haven't been mapped yet.
+  switch (Stacks.grow(Addr)) {
+  case StackAllocator::GrowResult::Grown:
+    E.sync();
+    return true;
+  case StackAllocator::GrowResult::Overflow:
+    return false;
+  case StackAllocator::GrowResult::NotStack:
+    break;
+  }
+
+  // The memory can belong to a not yet filled part of some segment.
+  if (DemandPaging && Dyld.mapDeferred(Addr)) {
+    E.sync();
+    return true;
+  }
+
+  // Map the memory, so that emulation can continue. If it's part of some host
+  // allocation (e.g., heap arena), map all of it at once, so that the guest
+  // doesn't fault again on its other pages. Mach-O images are excluded, they
+  // can contain deferred chunks which must stay unmapped until filled.
+  LoadedLibrary *Lib = Dyld.lookup(Addr).Lib;
+  if ((!Lib || !Lib->isDylib()) &&
+      E.mapHostRegion(Addr, UC_PROT_READ | UC_PROT_WRITE))
+    return true;
   Addr = DynamicLoader::alignToPageSize(Addr);
   Size = DynamicLoader::roundToPageSize(Size);
-  Emu.mapMemory(Addr, Size, UC_PROT_READ | UC_PROT_WRITE);
+  E.mapMemory(Addr, Size, UC_PROT_READ | UC_PROT_WRITE);
+  E.sync();
 
   return true;
 }
 
+bool SysTranslator::handleFetchUnmapped(uc_mem_type Type, uint64_t Addr,
+                                        int Size, int64_t Value) {
+  // The code could have been mapped by another thread or deferred by
+  // `DynamicLoader`.
+  Emulator &E = getContext().Emu;
+  if (E.sync())
+    return true;
+  if (DemandPaging && Dyld.mapDeferred(Addr)) {
+    E.sync();
+    return true;
+  }
+
+  Log.error() << "fetching unmapped memory at " << Dyld.dumpAddr(Addr)
+              << Log.end();
+  return false;
+}
+
 void SysTranslator::handleTrampoline(void *Ret, void **Args, void *Data) {
+  ThreadContext &Ctx = getContext();
+
   auto *Tr = reinterpret_cast<Trampoline *>(Data);
 
   if constexpr (PrintEmuInfo) {
@@ -345,16 +674,17 @@ void SysTranslator::handleTrampoline(void *Ret, void **Args, void *Data) {
   }
 
   // Pass arguments.
-  uc_arm_reg RegId = UC_ARM_REG_R0;
+  uint32_t Values[size(Emulator::ArgRegs)];
   for (size_t I = 0, ArgC = Tr->ArgC; I != ArgC; ++I)
-    Emu.writeReg(RegId++, *reinterpret_cast<uint32_t *>(Args[I]));
+    Values[I] = *reinterpret_cast<uint32_t *>(Args[I]);
+  Ctx.Emu.writeRegs(Emulator::ArgRegs, Values, Tr->ArgC);
 
   // Call the function.
   execute(Tr->Addr);
 
   // Extract return value.
   if (Tr->Returns)
-    *reinterpret_cast<ffi_arg *>(Ret) = Emu.readReg(UC_ARM_REG_R0);
+    *reinterpret_cast<ffi_arg *>(Ret) = Ctx.Emu.readReg(UC_ARM_REG_R0);
 }
 
 void SysTranslator::handleTrampolineStatic(ffi_cif *, void *Ret, void **Args,
@@ -362,9 +692,79 @@ void SysTranslator::handleTrampolineStatic(ffi_cif *, void *Ret, void **Args,
   IpaSim.Sys.handleTrampoline(Ret, Args, Data);
 }
 
+SysTranslator::Trampoline::~Trampoline() {
+  if (Closure)
+    ffi_closure_free(Closure);
+}
+
+SysTranslator::TranslationStats SysTranslator::getTranslationStats() {
+  lock_guard<mutex> Lock(Mutex);
+  TranslationStats Result(Stats);
+  Result.Trampolines = Trampolines.size();
+  return Result;
+}
+
+// Translations depend on which libraries are loaded, so they are discarded
+// when a new library is loaded. Trampolines stay valid and are reused. `Mutex`
+// must be held.
+void SysTranslator::syncTranslations() {
+  if (TranslationGeneration != Dyld.getGeneration()) {
+    MethodTranslations.clear();
+    Translations.clear();
+    TranslationGeneration = Dyld.getGeneration();
+  }
+}
+
+// Note that `Mutex` is not held while translating, because that takes the
+// loader lock (and the loader can call `translate`, too).
+void *SysTranslator::translate(void *FP) {
+  uint64_t Addr = reinterpret_cast<uint64_t>(FP);
+  {
+    lock_guard<mutex> Lock(Mutex);
+    syncTranslations();
+    auto I = MethodTranslations.find(Addr);
+    if (I != MethodTranslations.end()) {
+      ++Stats.Hits;
+      return I->second;
+    }
+    ++Stats.Misses;
+  }
+
+  void *Result = translateMethod(FP);
+  if (Result) {
+    lock_guard<mutex> Lock(Mutex);
+    syncTranslations();
+    MethodTranslations[Addr] = Result;
+  }
+  return Result;
+}
+
+void *SysTranslator::translate(void *FP, size_t ArgC, bool Returns) {
+  TranslationKey Key{reinterpret_cast<uint64_t>(FP), ArgC, Returns};
+  {
+    lock_guard<mutex> Lock(Mutex);
+    syncTranslations();
+    auto I = Translations.find(Key);
+    if (I != Translations.end()) {
+      ++Stats.Hits;
+      return I->second;
+    }
+    ++Stats.Misses;
+  }
+
+  void *Result = translateFunction(FP, ArgC, Returns);
+  if (Result) {
+    lock_guard<mutex> Lock(Mutex);
+    syncTranslations();
+    Translations[Key] = Result;
+  }
+  return Result;
+}
+
 // If `FP` points to emulated code, returns address of wrapper that should be
 // called instead. Otherwise, returns `FP` unchanged.
-void *SysTranslator::translate(void *FP) {
+void *SysTranslator::translateMethod(void *FP) {
+  auto DyldLock = Dyld.lock();
   uint64_t Addr = reinterpret_cast<uint64_t>(FP);
   LibraryInfo LI(Dyld.lookup(Addr));
 
@@ -387,48 +787,34 @@ void *SysTranslator::translate(void *FP) {
     Log.info() << "dynamically handling callback " << Dyld.dumpAddr(Addr, LI, M)
                << Log.end();
 
-  // First, handle the return value.
-  TypeDecoder TD(M.getType());
-  bool Returns;
-  switch (TD.getNextTypeSize()) {
-  case 0:
-    Returns = false;
-    break;
-  case 4:
-    Returns = true;
-    break;
-  default:
+  shared_ptr<const CallPlan> Plan = Types.getCallPlan(M.getType());
+  if (!Plan)
+    return nullptr;
+
+  // Trampolines support only values passed in single registers.
+  const TypeLayout &Ret = Plan->getReturnType();
+  if (Plan->returnsIndirectly() || Ret.Size > 4) {
     Log.error("unsupported return type of callback");
     return nullptr;
   }
-
-  // Next, process function arguments.
-  size_t ArgC = 0;
-  while (TD.hasNext()) {
-    switch (TD.getNextTypeSize()) {
-    case TypeDecoder::InvalidSize:
-      return nullptr;
-    case 4: {
-      if (ArgC > 3) {
-        Log.error("callback has too many arguments");
-        return nullptr;
-      }
-      ++ArgC;
-      break;
-    }
-    default:
+  size_t ArgC = Plan->getArgCount();
+  if (ArgC > size(Emulator::ArgRegs)) {
+    Log.error("callback has too many arguments");
+    return nullptr;
+  }
+  for (size_t I = 0; I != ArgC; ++I)
+    if (Plan->getArgType(I).Size > 4) {
       Log.error("unsupported callback argument type");
       return nullptr;
     }
-  }
+  bool Returns = Ret.Size != 0;
 
   // Now, create trampoline.
   return createTrampoline(FP, ArgC, Returns);
 }
 
-void *SysTranslator::translate(void *FP, size_t ArgC, bool Returns) {
-  using namespace LIEF::MachO;
-
+void *SysTranslator::translateFunction(void *FP, size_t ArgC, bool Returns) {
+  auto DyldLock = Dyld.lock();
   uint64_t Addr = reinterpret_cast<uint64_t>(FP);
   LibraryInfo LI(IpaSim.Dyld.lookup(Addr));
 
@@ -441,16 +827,16 @@ void *SysTranslator::translate(void *FP, size_t ArgC, bool Returns) {
   // If `FP` is a Dylib wrapper, we can skip it, we just need to find what it
   // wraps.
   if (Dylib->IsWrapper)
-    for (Symbol &Symbol : Dylib->lookup(Addr)) {
+    for (const SymbolIndex::Entry &Symbol : Dylib->lookup(Addr)) {
       // Find special symbol name.
-      if (!startsWith(Symbol.name(), WrapsPrefix))
+      if (strncmp(Symbol.Name, WrapsPrefix.S, WrapsPrefix.Len))
         continue;
 
       // Parse the special name.
-      const char *Postfix = Symbol.name().c_str() + WrapsPrefix.Len;
+      const char *Postfix = Symbol.Name + WrapsPrefix.Len;
       const char *Underscore = strchr(Postfix, '_');
       if (!Underscore) {
-        Log.error() << "invalid special symbol " << Symbol.name() << Log.end();
+        Log.error() << "invalid special symbol " << Symbol.Name << Log.end();
         continue;
       }
       uint64_t RVA = atol(Underscore + 1);
@@ -459,19 +845,19 @@ void *SysTranslator::translate(void *FP, size_t ArgC, bool Returns) {
       // Load the wrapped library.
       LoadedLibrary *Lib = Dyld.load(DLLName);
       if (!Lib) {
-        Log.error() << "couldn't load DLL for symbol " << Symbol.name()
+        Log.error() << "couldn't load DLL for symbol " << Symbol.Name
                     << Log.end();
         continue;
       }
       if (RVA >= Lib->Size) {
-        Log.error() << "RVA out of bounds for symbol " << Symbol.name()
+        Log.error() << "RVA out of bounds for symbol " << Symbol.Name
                     << Log.end();
         continue;
       }
 
       Addr = Lib->StartAddress + RVA - DLLBase;
       if constexpr (PrintEmuInfo)
-        Log.info() << "skipped wrapper for symbol " << Symbol.name() << " ("
+        Log.info() << "skipped wrapper for symbol " << Symbol.Name << " ("
                    << Dyld.dumpAddr(Addr) << ")" << Log.end();
       return reinterpret_cast<void *>(Addr);
     }
@@ -481,18 +867,22 @@ void *SysTranslator::translate(void *FP, size_t ArgC, bool Returns) {
 
 void *SysTranslator::createTrampoline(void *FP, size_t ArgC, bool Returns) {
   assert(ArgC <= 4);
+  lock_guard<mutex> Lock(Mutex);
+
+  // Reuse existing trampoline if possible.
+  TranslationKey Key{reinterpret_cast<uint64_t>(FP), ArgC, Returns};
+  auto I = Trampolines.find(Key);
+  if (I != Trampolines.end())
+    return I->second->Ptr;
 
-  // TODO: Don't create different trampolines for the same `FP`.
-  auto *Tr = new Trampoline;
+  auto Tr = make_unique<Trampoline>();
   Tr->Returns = Returns;
   Tr->ArgC = ArgC;
-  Tr->Addr = reinterpret_cast<uint64_t>(FP);
+  Tr->Addr = Key.Addr;
 
-  void *Ptr;
-  // TODO: `Closure` nor `Tr` are never deallocated.
-  auto *Closure = reinterpret_cast<ffi_closure *>(
-      ffi_closure_alloc(sizeof(ffi_closure), &Ptr));
-  if (!Closure) {
+  Tr->Closure = reinterpret_cast<ffi_closure *>(
+      ffi_closure_alloc(sizeof(ffi_closure), &Tr->Ptr));
+  if (!Tr->Closure) {
     Log.error("couldn't allocate closure");
     return nullptr;
   }
@@ -504,11 +894,14 @@ void *SysTranslator::createTrampoline(void *FP, size_t ArgC, bool Returns) {
     Log.error("couldn't prepare CIF");
     return nullptr;
   }
-  if (ffi_prep_closure_loc(Closure, &Tr->CIF, handleTrampolineStatic, Tr,
-                           Ptr) != FFI_OK) {
+  if (ffi_prep_closure_loc(Tr->Closure, &Tr->CIF, handleTrampolineStatic,
+                           Tr.get(), Tr->Ptr) != FFI_OK) {
     Log.error("couldn't prepare closure");
     return nullptr;
   }
+
+  void *Ptr = Tr->Ptr;
+  Trampolines[Key] = move(Tr);
   return Ptr;
 }
 
@@ -516,94 +909,63 @@ void *SysTranslator::createTrampoline(void *FP, size_t ArgC, bool Returns) {
 // DynamicCaller
 // =============================================================================
 
-void DynamicCaller::loadArg(size_t Size) {
-  for (size_t I = 0; I != Size; I += 4) {
-    if (RegId <= UC_ARM_REG_R3)
-      // We have some registers left, use them.
-      Args.push_back(Emu.readReg(RegId++));
-    else {
-      // Otherwise, use stack.
-      Args.push_back(*reinterpret_cast<uint32_t *>(SP));
-      SP += 4;
-    }
+DynamicCaller::DynamicCaller(Emulator &Emu, const CallPlan &Plan)
+    : Emu(Emu), Plan(Plan) {
+  // Read all argument registers and SP at once.
+  static constexpr uc_arm_reg RegIds[] = {UC_ARM_REG_R0, UC_ARM_REG_R1,
+                                          UC_ARM_REG_R2, UC_ARM_REG_R3,
+                                          UC_ARM_REG_SP};
+  static constexpr uint32_t RegCount = size(RegIds) - 1;
+  uint32_t Values[size(RegIds)];
+  Emu.readRegs(RegIds, Values, size(RegIds));
+
+  // Collect argument slots. Those that don't fit into registers are on the
+  // stack (which is in the host's address space, so it can be read directly).
+  uint32_t Count = Plan.getWordCount();
+  Words.append(Values, Values + min(Count, RegCount));
+  if (Count > RegCount) {
+    auto *Stack = reinterpret_cast<uint32_t *>(Values[RegCount]);
+    Words.append(Stack, Stack + (Count - RegCount));
   }
 }
 
-bool DynamicCaller::call(bool Returns, uint32_t Addr) {
-#define CASE(N)                                                                \
-  case N:                                                                      \
-    call<N>(Returns, Addr);                                                    \
-    break
-
-  switch (Args.size()) {
-    CASE(0);
-    CASE(1);
-    CASE(2);
-    CASE(3);
-    CASE(4);
-    CASE(5);
-    CASE(6);
-  default:
-    Log.error("function has too many arguments");
-    return false;
-  }
-  return true;
-
-#undef CASE
-}
-
-// =============================================================================
-// TypeDecoder
-// =============================================================================
-
-size_t TypeDecoder::getNextTypeSizeImpl() {
-  switch (*T) {
-  case 'v': // void
-    return 0;
-  case 'c': // char
-  case '@': // id
-  case '#': // Class
-  case ':': // SEL
-  case 'i': // int
-  case 'I': // unsigned int
-  case 'f': // float
-    return 4;
-  case '^': // pointer to type
-    ++T;
-    getNextTypeSizeImpl(); // Skip the underlying type, it's not important.
-    return 4;
-  case '{': { // struct
-    // Skip name of the struct.
-    for (++T; *T != '='; ++T)
-      if (!*T) {
-        Log.error("struct type ended unexpectedly");
-        return InvalidSize;
-      }
-    ++T;
-
-    // Parse type recursively (note that the struct can be also empty).
-    size_t TotalSize = 0;
-    while (*T != '}') {
-      size_t Size = getNextTypeSize();
-      if (Size == InvalidSize)
-        return InvalidSize;
-      TotalSize += Size;
+void DynamicCaller::call(uint32_t Addr) {
+  llvm::SmallVector<uint64_t, 8> Scratch(
+      (Plan.ScratchSize + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+  auto *ScratchPtr = reinterpret_cast<uint8_t *>(Scratch.data());
+
+  // Point `libffi` to arguments. Aggregates laid out differently on the host
+  // must be copied.
+  llvm::SmallVector<void *, 8> Values;
+  auto *Bytes = reinterpret_cast<uint8_t *>(Words.data());
+  for (const CallPlan::Arg &A : Plan.Args) {
+    uint8_t *Guest = Bytes + A.Word * 4;
+    if (A.Moves.empty()) {
+      Values.push_back(Guest);
+      continue;
     }
-
-    return TotalSize;
+    uint8_t *Host = ScratchPtr + A.Scratch;
+    for (const CallPlan::Move &M : A.Moves)
+      memcpy(Host + M.Host, Guest + M.Guest, M.Size);
+    Values.push_back(Host);
   }
-  default:
-    Log.error("unsupported type encoding");
-    return InvalidSize;
-  }
-}
-
-size_t TypeDecoder::getNextTypeSize() {
-  size_t Result = getNextTypeSizeImpl();
 
-  // Skip digits.
-  for (++T; '0' <= *T && *T <= '9'; ++T)
-    ;
-
-  return Result;
+  // Call the function. Indirect result can be stored directly into the
+  // guest's memory if the layouts match.
+  auto *Guest = reinterpret_cast<uint8_t *>(Words.empty() ? 0 : Words[0]);
+  bool Direct = Plan.IndirectRet && Plan.RetMoves.empty();
+  uint8_t *Result = Direct ? Guest : ScratchPtr + Plan.RetScratch;
+  ffi_call(const_cast<ffi_cif *>(&Plan.CIF),
+           reinterpret_cast<void (*)()>(Addr), Result, Values.data());
+
+  // Pass the result back.
+  if (Plan.IndirectRet) {
+    for (const CallPlan::Move &M : Plan.RetMoves)
+      memcpy(Guest + M.Guest, Result + M.Host, M.Size);
+  } else if (Plan.Ret.Size) {
+    // 64-bit values are returned in `R0` and `R1`.
+    uint32_t Regs[2];
+    memcpy(Regs, Result, sizeof(Regs));
+    Emu.writeRegs(Emulator::ArgRegs, Regs, Plan.Ret.Size > 4 ? 2 : 1);
+  }
 }
@@ -2,6 +2,10 @@
 
 #include "..\..\deps\objc4\runtime\objc-private.h"
 
+#define IPASIM_IMPORT extern "C" __declspec(dllimport)
+
+// Imports of this function are bound to an emulated one by `DynamicLoader` (see
+// `DynamicLoader::bindLazySymbol`), so it's never called.
 OBJC_EXPORT void dyld_stub_binder() { assert(false); }
 
 // The original is in libobjc2/arc.mm.
@@ -17,6 +21,18 @@ bool dispatch_is_dispatch_object(const void *obj) {
     return dispatch_is_dispatch_object_p(obj);
 }
 
+// Decodes `type` using the type encoding cache in `IpaSimLibrary` (shared with
+// `SysTranslator`). Returns `false` if the encoding is not supported there, in
+// which case the parser below is used instead.
+IPASIM_IMPORT bool ipaSim_getTypeLayout(const char *type, size_t *size,
+                                        size_t *align);
+
+// Invalidates the guest-side method cache of `IpaSimLibrary` (see
+// `DynamicLoader::flushMsgCache`). Must be called after changing IMPs or class
+// hierarchy, since native callers of the functions doing that don't go through
+// `DynamicLoader`'s flush thunks.
+IPASIM_IMPORT void ipaSim_flushMsgCache();
+
 // Copied from libobjc2/encoding2.c.
 // TODO: Do these work correctly for our runtime? Maybe port Apple's NSGetSizeAndAlignment instead (if there is its source code).
 // TODO: This doesn't work, why?
@@ -182,7 +198,9 @@ static const char *alignof_type(const char *type, size_t *align)
 }
 OBJC_EXPORT size_t objc_alignof_type (const char *type)
 {
-	size_t align = 0;
+	size_t size, align = 0;
+	if (ipaSim_getTypeLayout(type, &size, &align))
+		return align;
 	alignof_type(type, &align);
 	return align / 8;
 }
@@ -294,15 +312,22 @@ OBJC_EXPORT const char *objc_skip_typespec(const char *type)
 }
 OBJC_EXPORT size_t objc_sizeof_type(const char *type)
 {
-	size_t size = 0;
+	size_t size = 0, align;
+	if (ipaSim_getTypeLayout(type, &size, &align))
+		return size;
 	sizeof_type(type, &size);
 	return size / 8;
 }
 OBJC_EXPORT size_t objc_aligned_size(const char *type)
 {
-	size_t size  = objc_sizeof_type(type);
-	size_t align = objc_alignof_type(type);
-	return size + (size % align);
+	size_t size, align;
+	if (!ipaSim_getTypeLayout(type, &size, &align))
+	{
+		size  = objc_sizeof_type(type);
+		align = objc_alignof_type(type);
+	}
+	// Round the size up to the alignment.
+	return align ? (size + align - 1) / align * align : size;
 }
 
 // Signatures copied from libobjc2/objc/runtime.h.
@@ -321,11 +346,15 @@ OBJC_EXPORT IMP objc_msg_lookup_super(struct objc_super *super, SEL _cmd) {
 // TODO: Implement these correctly!
 OBJC_EXPORT BOOL object_addMethod_np(id object, SEL name, IMP imp, const char *types)
 {
-	return class_addMethod(object, name, imp, types);
+	BOOL added = class_addMethod(object, name, imp, types);
+	ipaSim_flushMsgCache();
+	return added;
 }
 OBJC_EXPORT IMP object_replaceMethod_np(id object, SEL name, IMP imp, const char *types)
 {
-	return class_replaceMethod(object, name, imp, types);
+	IMP old = class_replaceMethod(object, name, imp, types);
+	ipaSim_flushMsgCache();
+	return old;
 }
 
 // From libobjc2/NSBlocks.mm.
@@ -361,5 +390,6 @@ OBJC_EXPORT BOOL objc_create_block_classes_as_subclasses_of(Class super) {
 	NEW_CLASS(&_NSBlock, _NSConcreteStackBlock);
 	NEW_CLASS(&_NSBlock, _NSConcreteGlobalBlock);
 	NEW_CLASS(&_NSBlock, _NSConcreteMallocBlock);
+	ipaSim_flushMsgCache();
 	return YES;
 }